@@ -24,8 +24,11 @@
 #include "Font.h"
 #include "Dialogs.h"
 #include "Event.h"
+#include "Http.h"
+#include "Worker.h"
 
 #include <cstdio>
+#include <cstdlib>
 #include <string>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -43,35 +46,70 @@ class App : private Container
   int   m_height;
   bool  m_rotate;  
   bool  m_thumbnailMode;
+  bool  m_thumbnailPng;
   bool  m_videoMode;
   std::string m_testOp;
+  std::string m_syncPack;
+  std::string m_sheet;
   bool  m_quit;
   bool  m_drawFps;
   bool  m_drawDirty;
   int   m_renderRate;
+  int   m_speed;  // simulation ticks per paced tick, 0 = as fast as possible
+  Window::Present    m_present;
   vector<const char*> m_files;
   Window            *m_window;
+  GameControl       *m_game;
 public:
   App(int argc, char** argv)
     : m_width(SCREEN_WIDTH),
       m_height(SCREEN_HEIGHT),
       m_rotate(false),
       m_thumbnailMode(false),
+      m_thumbnailPng(false),
       m_videoMode(false),
       m_quit(false),
       m_drawFps(false),
       m_drawDirty(false),
-      m_window(NULL)
+      m_speed(1),
+      m_present(Window::PRESENT_SURFACE),
+      m_window(NULL),
+      m_game(NULL)
   {
     for ( int i=1; i<argc; i++ ) {
       if ( strcmp(argv[i],"-test")==0 && i < argc-1) {
 	m_testOp = argv[i+++1];
       } else if ( strcmp(argv[i],"-bmp")==0 ) {
 	m_thumbnailMode = true;
+      } else if ( strcmp(argv[i],"-png")==0 ) {
+	m_thumbnailMode = true;
+	m_thumbnailPng = true;
       } else if ( strcmp(argv[i],"-video")==0 ) {
 	m_videoMode = true;
       } else if ( strcmp(argv[i],"-fps")==0 ) {
 	m_drawFps = true;
+      } else if ( strcmp(argv[i],"-speed")==0 && i<argc-1) {
+	m_speed = atoi(argv[++i]);
+	if ( m_speed < 0 ) {
+	  m_speed = 1;
+	}
+      } else if ( strcmp(argv[i],"-hash")==0 && i<argc-1) {
+	STATE_HASH_TICKS = atoi(argv[++i]);
+      } else if ( strcmp(argv[i],"-simthread")==0 ) {
+	SIMULATION_THREAD = true;
+      } else if ( strcmp(argv[i],"-substeps")==0 && i<argc-1) {
+	StepPolicy::defaults().maxSubSteps = atoi(argv[++i]);
+      } else if ( strcmp(argv[i],"-sheet")==0 && i<argc-1) {
+	m_thumbnailMode = true;
+	m_sheet = argv[++i];
+      } else if ( strcmp(argv[i],"-sync")==0 && i<argc-1) {
+	m_syncPack = argv[++i];
+      } else if ( strcmp(argv[i],"-tiles")==0 && i<argc-1) {
+	DRAW_TILE_SIZE = atoi(argv[++i]);
+      } else if ( strcmp(argv[i],"-spritecache")==0 && i<argc-1) {
+	SpriteCache::instance().maxBytes( atoi(argv[++i])*1024*1024 );
+      } else if ( strcmp(argv[i],"-present")==0 && i<argc-1) {
+	m_present = parsePresent(argv[++i]);
       } else if ( strcmp(argv[i],"-rotate")==0 ) {
 	m_rotate = true;
       } else if ( strcmp(argv[i],"-geometry")==0 && i<argc-1) {
@@ -100,6 +138,8 @@ public:
   {
     if ( m_testOp.length() > 0 ) {
       test( m_testOp );
+    } else if ( m_thumbnailMode && m_sheet.length() > 0 ) {
+      renderSheet( m_files, m_sheet.c_str(), m_width, m_height );
     } else if ( m_thumbnailMode ) {
       for ( size_t i=0; i<m_files.size(); i++ ) {
 	renderThumbnail( m_files[i], m_width, m_height );
@@ -109,9 +149,22 @@ public:
 	renderVideo( m_files[i], m_width, m_height );
       }
     } else {      
-      m_window = new Window(m_width,m_height,"Numpty Physics","NPhysics");
+      if ( m_syncPack.length() > 0 ) {
+	syncPack( m_syncPack );
+      }
+      m_window = new Window(m_width,m_height,"Numpty Physics","NPhysics",
+			    false,m_present);
       sizeTo(Vec2(m_width,m_height));
       runGame( m_files, m_width, m_height );
+      if ( m_drawFps ) {
+	SpriteCache& sprites = SpriteCache::instance();
+	int draws = sprites.hits() + sprites.misses();
+	fprintf(stderr,"sprites: %d hits, %d misses (%d%%), %d added, "
+		"%d kB in %d\n",
+		sprites.hits(), sprites.misses(),
+		draws ? sprites.hits()*100/draws : 0,
+		sprites.added(), sprites.bytes()/1024, sprites.size());
+      }
     }
   }
 
@@ -119,7 +172,9 @@ private:
 
   void init()
   {
-    if ( m_thumbnailMode || m_videoMode || m_testOp.length() > 0 ) {
+    if ( m_testOp == "present" ) {
+      // measures the real video driver, so leave it alone
+    } else if ( m_thumbnailMode || m_videoMode || m_testOp.length() > 0 ) {
       putenv((char*)"SDL_VIDEODRIVER=dummy");
     } else {
       putenv((char*)"SDL_VIDEO_X11_WMCLASS=NPhysics");
@@ -132,6 +187,139 @@ private:
   }
 
 
+  static Window::Present parsePresent( const char* s )
+  {
+    if ( strcmp(s,"texture")==0 ) {
+      return Window::PRESENT_TEXTURE;
+    } else if ( strcmp(s,"software")==0 ) {
+      return Window::PRESENT_SOFTWARE;
+    }
+    return Window::PRESENT_SURFACE;
+  }
+
+
+  /// time full screen and small dirty rect updates through each backend
+  void benchmarkPresent()
+  {
+    static const char* names[] = { "surface", "texture", "software" };
+    static const int FULL_FRAMES = 200;
+    static const int DIRTY_FRAMES = 1000;
+    static const int DIRTY_SIZE = 64;
+    for ( int p=Window::PRESENT_SURFACE; p<=Window::PRESENT_SOFTWARE; p++ ) {
+      Window window(m_width,m_height,"Numpty Physics","NPhysics",
+		    false,(Window::Present)p);
+      if ( window.present() != p ) {
+	fprintf(stderr,"present %s: unavailable\n",names[p]);
+	continue;
+      }
+      Rect full(0,0,m_width-1,m_height-1);
+      int start = SDL_GetTicks();
+      for ( int f=0; f<FULL_FRAMES; f++ ) {
+	window.drawRect( full, window.makeColour((f&1)?0xffffff:0x000000) );
+	window.update( full );
+	window.flush();
+      }
+      int fullTime = SDL_GetTicks() - start;
+
+      start = SDL_GetTicks();
+      for ( int f=0; f<DIRTY_FRAMES; f++ ) {
+	int x = (f*7) % (m_width-DIRTY_SIZE);
+	int y = (f*3) % (m_height-DIRTY_SIZE);
+	Rect dirty(x,y,x+DIRTY_SIZE-1,y+DIRTY_SIZE-1);
+	window.drawRect( dirty, window.makeColour((f&1)?0xff0000:0x0000ff) );
+	window.update( dirty );
+	window.flush();
+      }
+      int dirtyTime = SDL_GetTicks() - start;
+      fprintf(stderr,"present %s: full %.2fms/frame, %dx%d dirty %.3fms/frame\n",
+	      names[p], (float)fullTime/FULL_FRAMES,
+	      DIRTY_SIZE, DIRTY_SIZE, (float)dirtyTime/DIRTY_FRAMES);
+    }
+  }
+
+
+  /// many short strokes in every direction, like a busy level
+  static std::vector<Path> benchmarkStrokes( int w, int h )
+  {
+    std::vector<Path> strokes;
+    srand( 12345 );
+    for ( int s=0; s<200; s++ ) {
+      Path p;
+      int x = 10 + rand() % (w-20);
+      int y = 10 + rand() % (h-20);
+      for ( int i=0; i<40; i++ ) {
+	p.append( Vec2(x,y) );
+	x = std::max( 0, std::min( w-1, x + rand() % 61 - 30 ) );
+	y = std::max( 0, std::min( h-1, y + rand() % 61 - 30 ) );
+      }
+      strokes.push_back( p );
+    }
+    return strokes;
+  }
+
+  static int drawStrokes( Canvas& c, const std::vector<Path>& strokes,
+			  bool thick, int repeat )
+  {
+    int start = SDL_GetTicks();
+    for ( int r=0; r<repeat; r++ ) {
+      for ( size_t i=0; i<strokes.size(); i++ ) {
+	c.drawPath( strokes[i], c.makeColour(brushColours[i%NUM_BRUSHES]), thick );
+      }
+    }
+    return SDL_GetTicks() - start;
+  }
+
+  /// time strokes drawn a pixel at a time against a span at a time
+  void benchmarkLines()
+  {
+    std::vector<Path> strokes = benchmarkStrokes( m_width, m_height );
+    Canvas c( m_width, m_height );
+    bool spans = SPAN_LINES;
+    for ( int thick=0; thick<2; thick++ ) {
+      SPAN_LINES = false;
+      int pixelTime = drawStrokes( c, strokes, thick, 20 );
+      SPAN_LINES = true;
+      int spanTime = drawStrokes( c, strokes, thick, 20 );
+      fprintf(stderr,"%s lines: per pixel %dms, spans %dms\n",
+	      thick ? "thick" : "thin", pixelTime, spanTime);
+    }
+    SPAN_LINES = spans;
+  }
+
+  /// time a big redraw drawn serially against in tiles on the pool
+  void benchmarkTiles()
+  {
+    static const int W = 1920;
+    static const int H = 1080;
+    std::vector<Path> strokes = benchmarkStrokes( W, H );
+    Canvas c( W, H );
+    Rect all( 0, 0, W-1, H-1 );
+    int serialTime = drawStrokes( c, strokes, true, 10 );
+    int start = SDL_GetTicks();
+    for ( int r=0; r<10; r++ ) {
+      TiledPainter painter;
+      for ( size_t i=0; i<strokes.size(); i++ ) {
+	painter.add( strokes[i], c.makeColour(brushColours[i%NUM_BRUSHES]), true );
+      }
+      painter.paint( c, all );
+    }
+    int tiledTime = SDL_GetTicks() - start;
+    fprintf(stderr,"%dx%d thick lines: serial %dms, tiled %dms on %d threads\n",
+	    W, H, serialTime, tiledTime, ThreadPool::get().size());
+  }
+
+
+  void syncPack( const std::string& pack )
+  {
+    HttpClient client( Config::planetRoot() );
+    int n = client.syncPack( pack, Config::userDataDir() );
+    fprintf(stderr,"sync %s: %d new levels\n",pack.c_str(),n);
+    if ( client.errorMessage().length() > 0 ) {
+      fprintf(stderr,"sync %s: %s\n",pack.c_str(),client.errorMessage().c_str());
+    }
+  }
+
+
   void renderThumbnail( const char* file, int width, int height )
   {
     configureScreenTransform( width, height );
@@ -139,9 +327,112 @@ private:
     if ( scene.load( file ) ) {
       Canvas temp( width, height );
       scene.draw( temp, FULLSCREEN_RECT );
-      std::string bmp( file );
-      bmp += ".bmp";
-      temp.writeBMP( bmp.c_str() );
+      std::string out( file );
+      if ( m_thumbnailPng ) {
+	out += ".png";
+	temp.writePNG( out.c_str() );
+      } else {
+	out += ".bmp";
+	temp.writeBMP( out.c_str() );
+      }
+    }
+  }
+
+  typedef WorkerF<const std::string*, Vec2, Canvas**> ThumbnailWorker;
+
+  /// draw a level at the screen transform and scale it to an icon
+  static void drawThumbnail( const std::string* level, Vec2 size,
+			     Canvas** thumb )
+  {
+    try {
+      Scene scene( true );
+      if ( level->size()
+	   && scene.load( (unsigned char*)level->data(), level->size() ) ) {
+	Canvas temp( size.x, size.y );
+	scene.draw( temp, FULLSCREEN_RECT );
+	*thumb = temp.scale( ICON_SCALE_FACTOR );
+      }
+    } catch ( const std::exception& e ) {
+      // a broken level just leaves a gap in the sheet
+    } catch ( const char* e ) {
+    }
+  }
+
+  /// thumbnails of every level in files, SHEET_COLUMNS to a row, in one
+  /// PNG written a row of thumbnails at a time
+  void renderSheet( vector<const char*>& files, const char* sheet,
+		    int width, int height )
+  {
+    configureScreenTransform( width, height );
+    Levels levels;
+    for ( size_t i=0; i<files.size(); i++ ) {
+      levels.addPath( files[i] );
+    }
+    int n = levels.numLevels();
+    if ( n == 0 ) {
+      fprintf(stderr,"sheet %s: no levels\n",sheet);
+      return;
+    }
+
+    int tw = width / ICON_SCALE_FACTOR;
+    int th = height / ICON_SCALE_FACTOR;
+    int cols = std::min( n, SHEET_COLUMNS );
+    int rows = (n + cols - 1) / cols;
+    PngWriter png( sheet, cols*tw, rows*th );
+
+    // where each level landed, for whoever cuts the sheet up
+    std::string mapName( sheet );
+    mapName += ".txt";
+    FILE* map = fopen( mapName.c_str(), "w" );
+    if ( !map ) {
+      fprintf(stderr,"sheet %s: can't write %s\n",sheet,mapName.c_str());
+    }
+
+    // draw every thumbnail on the pool, then write them out in order as
+    // each row completes
+    std::vector<std::string> text( n );
+    std::vector<Canvas*> thumbs( n, (Canvas*)NULL );
+    std::vector<ThumbnailWorker*> workers( n );
+    for ( int level=0; level<n; level++ ) {
+      unsigned char buf[64*1024];
+      int size = levels.load( level, buf, sizeof(buf) );
+      text[level].assign( (const char*)buf, size );
+      workers[level] = new ThumbnailWorker( drawThumbnail, &text[level],
+					    Vec2(width,height),
+					    &thumbs[level] );
+      workers[level]->notify( false );
+      workers[level]->start( "thumbnail" );
+    }
+    for ( int r=0; r<rows; r++ ) {
+      for ( int c=0; c<cols; c++ ) {
+	int level = r*cols + c;
+	if ( level < n ) {
+	  workers[level]->wait();
+	  if ( map ) {
+	    fprintf(map,"%d %s\n", level, levels.levelName(level).c_str());
+	  }
+	}
+      }
+      for ( int y=0; y<th; y++ ) {
+	for ( int c=0; c<cols; c++ ) {
+	  int level = r*cols + c;
+	  if ( level < n && thumbs[level] ) {
+	    png.write( *thumbs[level], y, 0, tw );
+	  } else {
+	    png.fill( 0, tw );
+	  }
+	}
+      }
+      for ( int c=0; c<cols && r*cols+c<n; c++ ) {
+	delete workers[r*cols+c];
+	delete thumbs[r*cols+c];
+      }
+    }
+    if ( map ) {
+      fclose( map );
+    }
+    if ( !png.close() ) {
+      fprintf(stderr,"sheet %s: write failed\n",sheet);
     }
   }
 
@@ -157,17 +448,20 @@ private:
     Rect area(0,0,width,height);
     Canvas canvas(width,height);
     int iterateCounter = 0;
+    int speed = m_speed > 0 ? m_speed : VIDEO_MAX_SPEED;
 
     for ( int f=0; f<VIDEO_FPS*VIDEO_MAX_LEN; f++ ) {
       while ( iterateCounter < ITERATION_RATE ) {
-	m_children[0]->onTick( f*1000/VIDEO_FPS );
+	for ( int i=0; i<speed; i++ ) {
+	  m_children[0]->onTick( f*1000/VIDEO_FPS );
+	}
 	iterateCounter += VIDEO_FPS;
       }
       iterateCounter -= ITERATION_RATE;
       m_children[0]->draw( canvas, area );
       char bfile[128];
-      sprintf(bfile,"%s.%04d.bmp",file,f);
-      canvas.writeBMP( bfile );
+      sprintf(bfile,"%s.%04d.png",file,f);
+      canvas.writePNG( bfile );
     }
   }
 
@@ -189,8 +483,12 @@ private:
       levels.addPath( Config::userDataDir().c_str() );
     }
         
-    add( createGameLayer( &levels, width, height ), 0, 0 );
+    Widget* game = createGameLayer( &levels, width, height );
+    m_game = dynamic_cast<GameControl*>( game );
+    m_game->speed( m_speed );
+    add( game, 0, 0 );
     mainLoop();
+    m_game = NULL;
   }
 
   void render()
@@ -207,14 +505,22 @@ private:
       }
 
       if ( m_drawFps ) {
-	m_window->drawRect( Rect(0,0,50,50), m_window->makeColour(0xbfbf8f), true );
+	int w = m_speed == 1 ? 50 : 100;
+	m_window->drawRect( Rect(0,0,w,50), m_window->makeColour(0xbfbf8f), true );
 	char buf[32];
-	sprintf(buf,"%d",m_renderRate);
+	if ( m_speed == 1 ) {
+	  sprintf(buf,"%d",m_renderRate);
+	} else if ( m_speed > 1 ) {
+	  sprintf(buf,"%d x%d",m_renderRate,m_speed);
+	} else {
+	  sprintf(buf,"%d max",m_renderRate);
+	}
 	Font::headingFont()->drawLeft( m_window, Vec2(20,20), buf, 0 );
-	m_window->update( Rect(0,0,50,50) );
+	m_window->update( Rect(0,0,w,50) );
       }
 
       m_window->update( area );
+      m_window->flush();
     }
   }
 
@@ -264,6 +570,16 @@ private:
 	m_quit = true;
 	return true;
       case SDLK_3:
+	// cycle fast-forward 1x, 2x, 4x, max
+	switch ( m_speed ) {
+	case 1:  m_speed = 2; break;
+	case 2:  m_speed = 4; break;
+	case 4:  m_speed = 0; break;
+	default: m_speed = 1; break;
+	}
+	if ( m_game ) {
+	  m_game->speed( m_speed );
+	}
 	return true;
       default:
 	break;
@@ -284,35 +600,83 @@ private:
     return false;
   }
   
+  /// run the simulation for one paced tick at the current speed
+  void fastTick( int tick, int until )
+  {
+    if ( SIMULATION_THREAD ) {
+      // the simulation thread keeps m_speed itself
+      onTick( tick );
+    } else if ( m_speed > 0 ) {
+      for ( int i=0; i<m_speed; i++ ) {
+	onTick( tick );
+      }
+    } else {
+      // max speed: spend whatever is left of the frame on simulation
+      do {
+	onTick( tick );
+      } while ( (int)SDL_GetTicks() < until );
+    }
+  }
+
   void mainLoop()
   {
     render();
 
     m_renderRate = (MIN_RENDER_RATE+MAX_RENDER_RATE)/2;
-    int iterationRate = ITERATION_RATE;
-    int iterateCounter = 0;
+    // simulation time owed to the wall clock, in 1/ITERATION_RATE ms
+    int owed = 0;
     int lastTick = SDL_GetTicks();
+    int simClock = lastTick;
 
     while ( !m_quit ) {
       OS->poll();
 
-      //assumes RENDER_RATE <= ITERATION_RATE
-      while ( iterateCounter < iterationRate ) {
+      if ( m_speed != 0 && isIdle() && !isDirty() ) {
+	// nothing is moving: block until there is input to act on, waking
+	// now and then so the game can check for launch requests
+	SDL_Event ev;
+	if ( SDL_WaitEventTimeout( &ev, IDLE_WAIT_MS ) ) {
+	  processEvent( ev );
+	} else {
+	  onTick( SDL_GetTicks() );
+	}
+	lastTick = simClock = SDL_GetTicks();
+	continue;
+      }
+
+      int now = SDL_GetTicks();
+      owed += (now - simClock) * ITERATION_RATE;
+      simClock = now;
+      int ticks = 0;
+
+      do {
+	if ( m_speed == 0 || owed >= 1000 ) {
+	  fastTick( lastTick, lastTick + 1000/m_renderRate );
+	  owed -= 1000;
+	  ticks++;
+	}
 
-	onTick( lastTick );
-    
 	SDL_Event ev;
 	while ( SDL_PollEvent(&ev) ) {
 	  processEvent(ev);
 	}
 
 	if ( m_quit ) return;
-	iterateCounter += m_renderRate;
+      } while ( m_speed != 0 && owed >= 1000 && ticks < MAX_TICKS_PER_FRAME );
+
+      if ( owed >= 1000 || m_speed == 0 ) {
+	// can't keep up: drop the backlog instead of spiralling
+	owed = 0;
       }
-      iterateCounter -= iterationRate;
 
       render();
 
+      if ( m_speed == 0 ) {
+	// never sleep or back off the render rate when running flat out
+	lastTick = SDL_GetTicks();
+	continue;
+      }
+
       int sleepMs = lastTick + 1000/m_renderRate -  SDL_GetTicks();
 
       if ( sleepMs > 1 && m_renderRate < MAX_RENDER_RATE ) {
@@ -322,18 +686,45 @@ private:
 
       if ( sleepMs > 0 ) {
 	SDL_Delay( sleepMs );
-      } else {
-	if ( m_renderRate > MIN_RENDER_RATE ) {
-	  m_renderRate--;
-	} else if ( iterationRate > 30 ) {
-	  //slow down simulation time to maintain fps??
-	}
+      } else if ( m_renderRate > MIN_RENDER_RATE ) {
+	m_renderRate--;
       }
       lastTick = SDL_GetTicks();
     }
   }
   
 
+  typedef WorkerF<const char*, int*, int*> ReplayWorker;
+  static const int REPLAY_LOAD_FAILED = -2;
+
+  /// replay a demo and check it against its recorded state hashes
+  static void verifyReplay( const char* file, int* divergedAt, int* hashes )
+  {
+    try {
+      Scene scene;
+      if ( !scene.load( file ) ) {
+	*divergedAt = REPLAY_LOAD_FAILED;
+	return;
+      }
+      int last = scene.getLog()->lastHashTick();
+      *hashes = (int)scene.getLog()->numHashes();
+      if ( last == 0 ) {
+	*hashes = 0;
+	return;
+      }
+      scene.start( true );
+      while ( scene.replay()->ticks() < last && scene.divergedAt() < 0 ) {
+	scene.step();
+      }
+      *divergedAt = scene.divergedAt();
+    } catch ( const std::exception& e ) {
+      // eg a badly formed state hash
+      *divergedAt = REPLAY_LOAD_FAILED;
+    } catch ( const char* e ) {
+      *divergedAt = REPLAY_LOAD_FAILED;
+    }
+  }
+
   void test( std::string op ) 
   {
     if ( op=="levels" ) {
@@ -346,6 +737,38 @@ private:
 		  levels.levelName(j).c_str());
 	}
       }
+    } else if ( op=="replay" ) {
+      // replay every demo at once on the pool, reporting in file order
+      size_t n = m_files.size();
+      std::vector<int> divergedAt( n, -1 );
+      std::vector<int> hashes( n, 0 );
+      std::vector<ReplayWorker*> workers( n );
+      for ( size_t i=0; i<n; i++ ) {
+	workers[i] = new ReplayWorker( verifyReplay, m_files[i],
+				       &divergedAt[i], &hashes[i] );
+	workers[i]->notify( false );
+	workers[i]->start( "replay" );
+      }
+      for ( size_t i=0; i<n; i++ ) {
+	workers[i]->wait();
+	delete workers[i];
+	if ( divergedAt[i] == REPLAY_LOAD_FAILED ) {
+	  fprintf(stderr,"%s: failed to load\n",m_files[i]);
+	} else if ( hashes[i] == 0 ) {
+	  fprintf(stderr,"%s: no state hashes\n",m_files[i]);
+	} else if ( divergedAt[i] >= 0 ) {
+	  fprintf(stderr,"%s: DIVERGED at tick %d\n",m_files[i],
+		  divergedAt[i]);
+	} else {
+	  fprintf(stderr,"%s: ok, %d hashes\n",m_files[i],hashes[i]);
+	}
+      }
+    } else if ( op=="present" ) {
+      benchmarkPresent();
+    } else if ( op=="lines" ) {
+      benchmarkLines();
+    } else if ( op=="tiles" ) {
+      benchmarkTiles();
     } else if ( op=="rtf" ) {
       RichText r("the quick brown fox, jumped over the lazy dog!");
       r.layout(100);
@@ -19,11 +19,26 @@
 #include "Config.h"
 #include "Canvas.h"
 #include "Path.h"
+#include "Worker.h"
 #include <stdexcept>
+#include <climits>
+#include <algorithm>
+#include <vector>
+#include <map>
+#include <cmath>
+#include <cstring>
+#include <zlib.h>
 
 #include <SDL.h>
 #include <SDL_image.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define USE_NEON
+#endif
+
 #define Window X11Window //oops
 #define Font X11Font //oops
 #include "Swipe.h"
@@ -34,8 +49,6 @@
 #endif
 #undef Window
 
-// zoomer.cpp
-extern SDL_Surface *zoomSurface(SDL_Surface * src, double zoomx, double zoomy);
 
 
 // extract RGB colour components as 8bit values from RGB888
@@ -211,10 +224,381 @@ inline void renderLine( void *buf,
 }
 
 
+/// 32bpp brush for renderSpans(), inking whole runs of a line at once.
+/// It gives exactly the pixels that renderLine<Uint32,THICK> does.
+class SpanBrush32
+{
+ public:
+  // cheap enough to make on the stack for every path drawn
+  SpanBrush32( Uint32 c )
+    : m_c(c),
+      m_cRb(c & 0xff00ff),
+      m_cG(c & 0x00ff00)
+  {
+    ExtractRgb( c, m_r, m_g, m_b );
+  }
+
+  /// blend with weight a on the brush colour, as AlphaBlend() does
+  inline void blend( Uint32& p, int a ) const
+  {
+    if ( (unsigned)a <= ALPHA_MAX ) {
+      int ia = ALPHA_MAX - a;
+      // red and blue packed so both blend in one multiply
+      Uint32 rb = ((m_cRb * a + (p & 0xff00ff) * ia) >> 8) & 0xff00ff;
+      Uint32 g = ((m_cG * a + (p & 0x00ff00) * ia) >> 8) & 0x00ff00;
+      p = rb | g;
+    } else {
+      // coverage overshoots at the end of steep runs; keep the
+      // reference arithmetic for those
+      AlphaBlend( p, m_r, m_g, m_b, a, ALPHA_MAX - a );
+    }
+  }
+
+  /// blend n pixels stepping dir from p, pixel i weighted a0+i*da
+  void blendSpan( Uint32* p, int dir, int n, int a0, int da ) const
+  {
+    if ( dir < 0 ) {
+      // walk it the other way so the span is ascending in memory
+      p -= n-1;
+      a0 += (n-1)*da;
+      da = -da;
+    }
+    int i = 0;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i max = _mm_set1_epi16( ALPHA_MAX );
+    const __m128i c = _mm_unpacklo_epi8( _mm_set1_epi32(m_c), zero );
+    const __m128i rgbMask = _mm_set1_epi32( 0xffffff );
+    const __m128i step = _mm_set1_epi16( 4*da );
+    // coverage of pixels 0,1 and 2,3, per colour component
+    __m128i alo = _mm_set_epi16( a0+da, a0+da, a0+da, a0+da, a0, a0, a0, a0 );
+    __m128i ahi = _mm_add_epi16( alo, _mm_set1_epi16( 2*da ) );
+    for ( ; i+4<=n; i+=4 ) {
+      int a = a0 + i*da;
+      if ( (unsigned)a > ALPHA_MAX || (unsigned)(a+3*da) > ALPHA_MAX ) {
+	// coverage is linear so in range at both ends means all four are
+	break;
+      }
+      __m128i px = _mm_loadu_si128( (const __m128i*)(p+i) );
+      __m128i lo = _mm_unpacklo_epi8( px, zero );
+      __m128i hi = _mm_unpackhi_epi8( px, zero );
+      lo = _mm_add_epi16( _mm_mullo_epi16( c, alo ),
+			  _mm_mullo_epi16( lo, _mm_sub_epi16(max,alo) ) );
+      hi = _mm_add_epi16( _mm_mullo_epi16( c, ahi ),
+			  _mm_mullo_epi16( hi, _mm_sub_epi16(max,ahi) ) );
+      lo = _mm_srli_epi16( lo, 8 );
+      hi = _mm_srli_epi16( hi, 8 );
+      _mm_storeu_si128( (__m128i*)(p+i),
+			_mm_and_si128( _mm_packus_epi16(lo,hi), rgbMask ) );
+      alo = _mm_add_epi16( alo, step );
+      ahi = _mm_add_epi16( ahi, step );
+    }
+#endif
+    for ( ; i<n; i++ ) {
+      blend( p[i], a0 + i*da );
+    }
+  }
+
+  /// set n pixels stepping dir from p to the brush colour
+  void fillSpan( Uint32* p, int dir, int n ) const
+  {
+    if ( dir < 0 ) {
+      p -= n-1;
+    }
+    for ( int i=0; i<n; i++ ) {
+      p[i] = m_c;
+    }
+  }
+
+  Uint32 colour() const { return m_c; }
+
+ private:
+  Uint32 m_c;
+  Uint32 m_cRb, m_cG;  // the colour masked to red and blue, and green
+  int m_r, m_g, m_b;
+};
+
+
+/// shallowest slope, in steps per row, that renderSpans() batches
+static const int SPAN_MIN_RUN = 4;
+
+/// renderLine<Uint32,THICK> batched along the major axis: on shallow
+/// lines each run of steps on one row is inked as a span per brush row
+template <unsigned THICK>
+inline void renderSpans( void *buf,
+			 int byteStride,
+			 int x1, int y1, int x2, int y2,
+			 const SpanBrush32& brush )
+{
+  Uint32 *pix = (Uint32*)((char*)buf+byteStride*y1) + x1;
+  int lg_delta, sh_delta, cycle, lg_step, sh_step;
+  int alpha, alpha_step, alpha_reset;
+  int pixStride = byteStride/sizeof(Uint32);
+
+  lg_delta = x2 - x1;
+  sh_delta = y2 - y1;
+  lg_step = Sgn(lg_delta);
+  lg_delta = Abs(lg_delta);
+  sh_step = Sgn(sh_delta);
+  sh_delta = Abs(sh_delta);
+  if ( sh_step < 0 )  pixStride = -pixStride;
+  alpha = ALPHA_MAX >> 1;
+
+  if ( sh_delta * SPAN_MIN_RUN <= lg_delta ) {
+    cycle = lg_delta >> 1;
+    alpha_step = -(ALPHA_MAX * sh_delta/(lg_delta+1));
+    alpha_reset = alpha_step < 0 ? ALPHA_MAX : 0;
+    int count = lg_step>0 ? x2-x1 : x1-x2;
+    while ( count > 0 ) {
+      // steps until cycle passes lg_delta and we move to the next row
+      int run = sh_delta > 0 ? (lg_delta - cycle) / sh_delta + 1 : count;
+      bool rowChange = run <= count;
+      if ( !rowChange ) {
+	run = count;
+      }
+      brush.blendSpan( pix-pixStride, lg_step, run, alpha, alpha_step );
+      if ( THICK == 3 ) {
+	brush.fillSpan( pix, lg_step, run );
+	brush.blendSpan( pix+pixStride, lg_step, run,
+			 ALPHA_MAX-alpha, -alpha_step );
+      } else {
+	brush.blendSpan( pix, lg_step, run, ALPHA_MAX-alpha, -alpha_step );
+      }
+      count -= run;
+      pix += run * lg_step;
+      if ( rowChange ) {
+	cycle += run * sh_delta - lg_delta;
+	alpha = alpha_reset;
+	pix += pixStride;
+      }
+    }
+    return;
+  }
+
+  // runs too short to be worth batching: step along the major axis
+  // inking the brush as one short span across it
+  int major, minor, count, along, across, jump;
+  if ( sh_delta < lg_delta ) {
+    major = lg_delta;
+    minor = sh_delta;
+    alpha_step = -(ALPHA_MAX * sh_delta/(lg_delta+1));
+    count = lg_step>0 ? x2-x1 : x1-x2;
+    along = lg_step;
+    across = pixStride;
+    jump = pixStride;
+  } else {
+    major = sh_delta;
+    minor = lg_delta;
+    alpha_step = -lg_step * Abs(ALPHA_MAX * lg_delta/(sh_delta+1));
+    count = sh_step>0 ? y2-y1 : y1-y2;
+    along = pixStride;
+    across = 1;
+    jump = lg_step;
+  }
+  cycle = major >> 1;
+  alpha_reset = alpha_step < 0 ? ALPHA_MAX : 0;
+  while ( count-- ) {
+    brush.blend( pix[-across], alpha );
+    if ( THICK == 3 ) {
+      pix[0] = brush.colour();
+      brush.blend( pix[across], ALPHA_MAX-alpha );
+    } else {
+      brush.blend( pix[0], ALPHA_MAX-alpha );
+    }
+    cycle += minor;
+    alpha += alpha_step;
+    pix += along;
+    if ( cycle > major ) {
+      cycle -= major;
+      alpha = alpha_reset;
+      pix += jump;
+    }
+  }
+}
+
+
+/// Liang-Barsky: narrow [t0,t1] to the part of x1,y1 -> x2,y2 inside r
+/// @return false if none of it is
+static bool clipSegment( float x1, float y1, float x2, float y2,
+			 const Rect& r, float& t0, float& t1 )
+{
+  const float dx = x2 - x1;
+  const float dy = y2 - y1;
+  const float p[4] = { -dx, dx, -dy, dy };
+  const float q[4] = { x1 - r.tl.x, r.br.x - x1, y1 - r.tl.y, r.br.y - y1 };
+  for ( int i=0; i<4; i++ ) {
+    if ( p[i] == 0 ) {
+      if ( q[i] < 0 ) {
+	return false;
+      }
+    } else {
+      float t = q[i] / p[i];
+      if ( p[i] < 0 ) {
+	if ( t > t1 ) return false;
+	if ( t > t0 ) t0 = t;
+      } else {
+	if ( t < t0 ) return false;
+	if ( t < t1 ) t1 = t;
+      }
+    }
+  }
+  return true;
+}
+
+template <typename PIX>
+inline void clippedBlend( void *buf, int byteStride, const Rect& clip,
+			  const Vec2& p, int cr, int cg, int cb, int a )
+{
+  if ( clip.contains( p ) ) {
+    AlphaBlend( ((PIX*)((char*)buf+byteStride*p.y))[p.x], cr, cg, cb,
+		a, ALPHA_MAX - a );
+  }
+}
+
+/// renderLine() for a segment crossing the clip rect. It steps the
+/// same way so every pixel matches an unclipped draw, but jumps straight
+/// over the steps Liang-Barsky puts before clip, stops after those past
+/// it and inks only pixels within it.
+template <typename PIX, unsigned THICK>
+inline void renderLineClipped( void *buf,
+			       int byteStride,
+			       int x1, int y1, int x2, int y2,
+			       PIX color, const Rect& clip )
+{
+  int lg_delta, sh_delta, cycle, lg_step, sh_step;
+  int alpha, alpha_step, alpha_reset;
+  int cr, cg, cb;
+  ExtractRgb( color, cr, cg, cb );
+
+  lg_delta = x2 - x1;
+  sh_delta = y2 - y1;
+  lg_step = Sgn(lg_delta);
+  lg_delta = Abs(lg_delta);
+  sh_step = Sgn(sh_delta);
+  sh_delta = Abs(sh_delta);
+
+  // the same walk as renderLine with pixel coordinates for a pointer
+  int major, minor, count;
+  Vec2 along, across, jump;
+  if ( sh_delta < lg_delta ) {
+    major = lg_delta;
+    minor = sh_delta;
+    alpha_step = -(ALPHA_MAX * sh_delta/(lg_delta+1));
+    count = lg_delta;
+    along = Vec2(lg_step,0);
+    across = Vec2(0,sh_step);
+    jump = Vec2(0,sh_step);
+  } else {
+    major = sh_delta;
+    minor = lg_delta;
+    alpha_step = -lg_step * Abs(ALPHA_MAX * lg_delta/(sh_delta+1));
+    count = sh_delta;
+    along = Vec2(0,sh_step);
+    across = Vec2(1,0);
+    jump = Vec2(lg_step,0);
+  }
+  cycle = major >> 1;
+  alpha = ALPHA_MAX >> 1;
+  alpha_reset = alpha_step < 0 ? ALPHA_MAX : 0;
+
+  // the brush reaches a pixel across the line and the steps stray up
+  // to a pixel from it, so widen clip by two to find the steps
+  Rect reach = clip;
+  reach.grow(2);
+  float t0 = 0, t1 = 1;
+  if ( count == 0
+       || !clipSegment( x1, y1, x2, y2, reach, t0, t1 ) ) {
+    return;
+  }
+  int first = (int)(t0 * count);
+  int last = std::min( count, (int)(t1 * count) + 2 );
+
+  // where the walk is after first steps: each step adds minor to cycle
+  // and takes a jump, resetting alpha, whenever that passes major
+  int raw = cycle + first*minor;
+  int jumps = raw > 0 ? (raw-1) / major : 0;
+  cycle = raw - jumps*major;
+  if ( jumps > 0 ) {
+    // the step that took the last jump
+    int lastJump = (jumps*major + 1 - (major>>1) + minor-1) / minor;
+    alpha = alpha_reset + (first-lastJump)*alpha_step;
+  } else {
+    alpha += first*alpha_step;
+  }
+  Vec2 pos = Vec2(x1,y1) + along*first + jump*jumps;
+  for ( int s=first; s<last; s++ ) {
+    clippedBlend<PIX>( buf, byteStride, clip, pos - across,
+		       cr, cg, cb, alpha );
+    if ( THICK == 3 ) {
+      if ( clip.contains( pos ) ) {
+	((PIX*)((char*)buf+byteStride*pos.y))[pos.x] = color;
+      }
+      clippedBlend<PIX>( buf, byteStride, clip, pos + across,
+			 cr, cg, cb, ALPHA_MAX - alpha );
+    } else {
+      clippedBlend<PIX>( buf, byteStride, clip, pos,
+			 cr, cg, cb, ALPHA_MAX - alpha );
+    }
+    cycle += minor;
+    alpha += alpha_step;
+    pos += along;
+    if ( cycle > major ) {
+      cycle -= major;
+      alpha = alpha_reset;
+      pos += jump;
+    }
+  }
+}
+
+
+// halve each colour component of n pixels, as fade() does
+static void fadeRow32( Uint32* p, int n )
+{
+  int i = 0;
+#if defined(__SSE2__)
+  const __m128i mask = _mm_set1_epi32( 0x7f7f7f );
+  for ( ; i+4<=n; i+=4 ) {
+    __m128i v = _mm_loadu_si128( (const __m128i*)(p+i) );
+    _mm_storeu_si128( (__m128i*)(p+i), _mm_and_si128(_mm_srli_epi32(v,1),mask) );
+  }
+#elif defined(USE_NEON)
+  const uint32x4_t mask = vdupq_n_u32( 0x7f7f7f );
+  for ( ; i+4<=n; i+=4 ) {
+    vst1q_u32( p+i, vandq_u32(vshrq_n_u32(vld1q_u32(p+i),1),mask) );
+  }
+#endif
+  for ( ; i<n; i++ ) {
+    p[i] = (p[i]>>1) & 0x7f7f7f;
+  }
+}
+
+static void fadeRow16( Uint16* p, int n )
+{
+  int i = 0;
+#if defined(__SSE2__)
+  const __m128i mask = _mm_set1_epi16( 0x7bef );
+  for ( ; i+8<=n; i+=8 ) {
+    __m128i v = _mm_loadu_si128( (const __m128i*)(p+i) );
+    _mm_storeu_si128( (__m128i*)(p+i), _mm_and_si128(_mm_srli_epi16(v,1),mask) );
+  }
+#elif defined(USE_NEON)
+  const uint16x8_t mask = vdupq_n_u16( 0x7bef );
+  for ( ; i+8<=n; i+=8 ) {
+    vst1q_u16( p+i, vandq_u16(vshrq_n_u16(vld1q_u16(p+i),1),mask) );
+  }
+#endif
+  for ( ; i<n; i++ ) {
+    p[i] = (p[i]>>1) & 0x7bef;
+  }
+}
+
+
 Canvas::Canvas( int w, int h )
   : m_surface(NULL),
     m_bgColour(0),
-    m_bgImage(NULL)
+    m_bgImage(NULL),
+    m_bgFaded(NULL),
+    m_bgFadedFrom(NULL)
 {
   m_surface = SDL_CreateRGBSurface( SDL_SWSURFACE, w, h, 32,
 				    0xFF0000, 0x00FF00, 0x0000FF, 0xFF000000 );
@@ -225,13 +609,16 @@ Canvas::Canvas( int w, int h )
 Canvas::Canvas( SDL_Surface* surface )
   : m_surface(surface),
     m_bgColour(0),
-    m_bgImage(NULL)
+    m_bgImage(NULL),
+    m_bgFaded(NULL),
+    m_bgFadedFrom(NULL)
 {
   resetClip();
 }
 
 Canvas::~Canvas()
 {
+  delete m_bgFaded;
   if (m_surface) {
     SDL_FreeSurface(m_surface);
   }
@@ -296,35 +683,157 @@ void Canvas::fade( const Rect& rr )
   Uint32 bpp;
   Rect r = rr;
   r.clipTo( m_clip );
+  if ( r.isEmpty() ) {
+    return;
+  }
   bpp = m_surface->format->BytesPerPixel;
-  char* row = (char*)m_surface->pixels;
-  int pixStride = width();
-  int w = r.br.x - r.tl.x;
-  int h = r.br.y - r.tl.y;
-  row += (r.tl.x + r.tl.y * pixStride) * bpp;
+  int w = r.width();
+  int h = r.height();
 
   SDL_LockSurface(m_surface);
+  char* row = (char*)m_surface->pixels + r.tl.y*m_surface->pitch + r.tl.x*bpp;
   switch ( bpp ) {
   case 2: 
     for ( int r=h; r>0; r-- ) {
-      for ( int i=0;i<w;i++) {
-	((Uint16*)row)[i] = (((Uint16*)row)[i]>>1) & 0x7bef;
-      }
-      row += pixStride * bpp;
+      fadeRow16( (Uint16*)row, w );
+      row += m_surface->pitch;
     }
     break;
   case 4:
     for ( int r=h; r>0; r-- ) {
-      for ( int i=0;i<w;i++) {
-	((Uint32*)row)[i] = (((Uint32*)row)[i]>>1) & 0x7f7f7f;
-      }
-      row += pixStride * bpp;
+      fadeRow32( (Uint32*)row, w );
+      row += m_surface->pitch;
     }
     break;
   }
   SDL_UnlockSurface(m_surface);
 }
 
+int Canvas::fadeColour( int c ) const
+{
+  if ( m_surface->format->BytesPerPixel == 2 ) {
+    return (c>>1) & 0x7bef;
+  }
+  return (c>>1) & 0x7f7f7f;
+}
+
+
+Canvas* Canvas::compatible() const
+{
+  const SDL_PixelFormat* f = m_surface->format;
+  SDL_Surface* s = SDL_CreateRGBSurface( 0, width(), height(),
+					 f->BitsPerPixel,
+					 f->Rmask, f->Gmask, f->Bmask, f->Amask );
+  if ( s == NULL ) {
+    throw std::runtime_error("Failed to create surface");
+  }
+  SDL_SetSurfaceBlendMode( s, SDL_BLENDMODE_NONE );
+  return new Canvas( s );
+}
+
+/// rows of a locked surface holding PIX sized pixels
+template <typename PIX>
+class PixelRows
+{
+ public:
+  PixelRows( SDL_Surface* s )
+    : m_pixels( (Uint8*)s->pixels ), m_pitch( s->pitch ) {}
+  inline PIX* row( int y ) const { return (PIX*)(m_pixels + y*m_pitch); }
+  inline PIX& at( int x, int y ) const { return row(y)[x]; }
+ private:
+  Uint8* m_pixels;
+  int    m_pitch;
+};
+
+/// SDL_GetRGB and SDL_MapRGB for formats without palettes, inline
+class PixelChannels
+{
+ public:
+  PixelChannels( const SDL_PixelFormat* f ) : m_f( f ) {}
+  inline void unpack( Uint32 p, int& r, int& g, int& b ) const
+  {
+    r = ((p & m_f->Rmask) >> m_f->Rshift) << m_f->Rloss;
+    g = ((p & m_f->Gmask) >> m_f->Gshift) << m_f->Gloss;
+    b = ((p & m_f->Bmask) >> m_f->Bshift) << m_f->Bloss;
+  }
+  inline Uint32 pack( int r, int g, int b ) const
+  {
+    return ((r >> m_f->Rloss) << m_f->Rshift)
+      | ((g >> m_f->Gloss) << m_f->Gshift)
+      | ((b >> m_f->Bloss) << m_f->Bshift)
+      | m_f->Amask;
+  }
+ private:
+  const SDL_PixelFormat* m_f;
+};
+
+/// average factor x factor blocks of locked src into locked dst
+template <typename PIX>
+static void boxDownscale( SDL_Surface* src, SDL_Surface* dst, int factor )
+{
+  PixelRows<PIX> in( src );
+  PixelRows<Uint32> out( dst );
+  PixelChannels from( src->format );
+  PixelChannels to( dst->format );
+  const int div = factor*factor;
+  for ( int y=0; y<dst->h; y++ ) {
+    Uint32* drow = out.row( y );
+    for ( int x=0; x<dst->w; x++ ) {
+      int r=0, g=0, b=0;
+      for ( int yy=0; yy<factor; yy++ ) {
+	const PIX* srow = in.row( y*factor+yy ) + x*factor;
+	for ( int xx=0; xx<factor; xx++ ) {
+	  int rr, gg, bb;
+	  from.unpack( srow[xx], rr, gg, bb );
+	  r += rr;
+	  g += gg;
+	  b += bb;
+	}
+      }
+      drow[x] = to.pack( r/div, g/div, b/div );
+    }
+  }
+}
+
+/// Bresenham line onto a locked surface, unclipped like drawPixel()
+template <typename PIX>
+static void plotLine( SDL_Surface* surface,
+		      int x1, int y1, int x2, int y2, int color )
+{
+  PixelRows<PIX> px( surface );
+  int lg_delta, sh_delta, cycle, lg_step, sh_step;
+  lg_delta = x2 - x1;
+  sh_delta = y2 - y1;
+  lg_step = Sgn(lg_delta);
+  lg_delta = Abs(lg_delta);
+  sh_step = Sgn(sh_delta);
+  sh_delta = Abs(sh_delta);
+  if (sh_delta < lg_delta) {
+    cycle = lg_delta >> 1;
+    while (x1 != x2) {
+      px.at( x1, y1 ) = color;
+      cycle += sh_delta;
+      if (cycle > lg_delta) {
+	cycle -= lg_delta;
+	y1 += sh_step;
+      }
+      x1 += lg_step;
+    }
+    px.at( x1, y1 ) = color;
+  }
+  cycle = sh_delta >> 1;
+  while (y1 != y2) {
+    px.at( x1, y1 ) = color;
+    cycle += lg_delta;
+    if (cycle > sh_delta) {
+      cycle -= sh_delta;
+      x1 += lg_step;
+    }
+    y1 += sh_step;
+  }
+  px.at( x1, y1 ) = color;
+}
+
 
 Canvas* Canvas::scale( int factor ) const
 {
@@ -376,41 +885,204 @@ Canvas* Canvas::scale( int factor ) const
 	}
 	drow += dpitch;
       }
+    } else if ( m_surface->format->BytesPerPixel==4 ) {
+      SDL_LockSurface( m_surface );
+      SDL_LockSurface( c->m_surface );
+      boxDownscale<Uint32>( m_surface, c->m_surface, factor );
+      SDL_UnlockSurface( c->m_surface );
+      SDL_UnlockSurface( m_surface );
+    }
+  }
+  return c;
+}
+
+
+/// weights in RESAMPLE_BITS fixed point, small enough for _mm_madd_epi16
+#define RESAMPLE_BITS 14
+#define RESAMPLE_ONE (1<<RESAMPLE_BITS)
+
+/// taps making up one output pixel along one axis
+struct ResampleTaps {
+  int first;               // source index of weights[0]
+  std::vector<int> weights;
+};
+
+/// Taps taking n source pixels to m: bilinear when enlarging, the area
+/// each output pixel covers when shrinking. Weights sum to RESAMPLE_ONE.
+static std::vector<ResampleTaps> resampleTaps( int n, int m )
+{
+  std::vector<ResampleTaps> taps( m );
+  const double ratio = (double)n / (double)m;
+  for ( int i=0; i<m; i++ ) {
+    std::vector<double> w;
+    int first;
+    if ( m >= n ) {
+      double s = (i + 0.5) * ratio - 0.5;
+      first = (int)floor( s );
+      double f = s - first;
+      w.push_back( 1.0 - f );
+      w.push_back( f );
     } else {
-      for ( int y=0;y<c->height();y++ ) {
-	for ( int x=0;x<c->width();x++ ) {
-	  int r=0,g=0,b=0;
-	  Uint8 rr,gg,bb;
-	  for ( int yy=0;yy<factor;yy++ ) {
-	    for ( int xx=0;xx<factor;xx++ ) {
-	      SDL_GetRGB( readPixel( x*factor+xx, y*factor+yy ),
-			  m_surface->format, &rr,&gg,&bb );
-	      r += rr;
-	      g += gg;
-	      b += bb;
-	    }
-	  }
-	  int div = factor*factor;
-	  c->drawPixel( x, y, makeColour(r/div,g/div,b/div) );
-	}
+      double lo = i * ratio, hi = (i+1) * ratio;
+      first = (int)floor( lo );
+      for ( int j=first; j<hi; j++ ) {
+	w.push_back( (std::min(hi,j+1.0) - std::max(lo,(double)j)) / ratio );
       }
     }
+    // fold taps beyond the edges onto the edge pixels
+    ResampleTaps& t = taps[i];
+    t.first = std::max( 0, std::min(n-1, first) );
+    int last = std::max( 0, std::min(n-1, first+(int)w.size()-1) );
+    t.weights.assign( last - t.first + 1, 0 );
+    int sum = 0, biggest = 0;
+    for ( size_t k=0; k<w.size(); k++ ) {
+      int j = std::max( 0, std::min(n-1, first+(int)k) ) - t.first;
+      int q = (int)(w[k] * RESAMPLE_ONE + 0.5);
+      t.weights[j] += q;
+      sum += q;
+    }
+    for ( size_t k=1; k<t.weights.size(); k++ ) {
+      if ( t.weights[k] > t.weights[biggest] ) {
+	biggest = k;
+      }
+    }
+    t.weights[biggest] += RESAMPLE_ONE - sum;
+  }
+  return taps;
+}
+
+/// resample one row of 32bpp pixels across, all four channels alike
+static void resampleRow( const Uint32* src, Uint32* dst,
+			 const std::vector<ResampleTaps>& taps )
+{
+  for ( size_t x=0; x<taps.size(); x++ ) {
+    const ResampleTaps& t = taps[x];
+    const Uint32* s = src + t.first;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = _mm_set1_epi32( RESAMPLE_ONE/2 );
+    for ( size_t k=0; k<t.weights.size(); k++ ) {
+      // one channel in the low half of each 32 bit lane
+      __m128i p = _mm_cvtsi32_si128( s[k] );
+      p = _mm_unpacklo_epi16( _mm_unpacklo_epi8( p, zero ), zero );
+      acc = _mm_add_epi32( acc, _mm_madd_epi16( p, _mm_set1_epi32(t.weights[k]) ) );
+    }
+    acc = _mm_srli_epi32( acc, RESAMPLE_BITS );
+    acc = _mm_packs_epi32( acc, acc );
+    dst[x] = _mm_cvtsi128_si32( _mm_packus_epi16( acc, acc ) );
+#else
+    Uint32 c0 = RESAMPLE_ONE/2, c1 = c0, c2 = c0, c3 = c0;
+    for ( size_t k=0; k<t.weights.size(); k++ ) {
+      Uint32 p = s[k];
+      int w = t.weights[k];
+      c0 += (p & 0xff) * w;
+      c1 += ((p >> 8) & 0xff) * w;
+      c2 += ((p >> 16) & 0xff) * w;
+      c3 += (p >> 24) * w;
+    }
+    dst[x] = (c0 >> RESAMPLE_BITS) | ((c1 >> RESAMPLE_BITS) << 8)
+      | ((c2 >> RESAMPLE_BITS) << 16) | ((c3 >> RESAMPLE_BITS) << 24);
+#endif
   }
-  return c;
 }
 
+/// dst = weighted sum of the rows from src, n bytes each
+static void resampleColumn( const Uint8* src, int pitch, Uint8* dst, int n,
+			    const ResampleTaps& t )
+{
+  const Uint8* s = src + t.first * pitch;
+  const int taps = (int)t.weights.size();
+  int i = 0;
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i half = _mm_set1_epi32( RESAMPLE_ONE/2 );
+  for ( ; i+16<=n; i+=16 ) {
+    __m128i acc0 = half, acc1 = half, acc2 = half, acc3 = half;
+    // rows two at a time, interleaved so madd weighs and adds both
+    for ( int k=0; k<taps; k+=2 ) {
+      const Uint8* a = s + k*pitch + i;
+      const Uint8* b = k+1 < taps ? a + pitch : a;
+      int wb = k+1 < taps ? t.weights[k+1] : 0;
+      __m128i w = _mm_set1_epi32( (wb << 16) | t.weights[k] );
+      __m128i pa = _mm_loadu_si128( (const __m128i*)a );
+      __m128i pb = _mm_loadu_si128( (const __m128i*)b );
+      __m128i lo = _mm_unpacklo_epi8( pa, pb );  // a0 b0 a1 b1 ...
+      __m128i hi = _mm_unpackhi_epi8( pa, pb );
+      acc0 = _mm_add_epi32( acc0, _mm_madd_epi16( _mm_unpacklo_epi8(lo,zero), w ) );
+      acc1 = _mm_add_epi32( acc1, _mm_madd_epi16( _mm_unpackhi_epi8(lo,zero), w ) );
+      acc2 = _mm_add_epi32( acc2, _mm_madd_epi16( _mm_unpacklo_epi8(hi,zero), w ) );
+      acc3 = _mm_add_epi32( acc3, _mm_madd_epi16( _mm_unpackhi_epi8(hi,zero), w ) );
+    }
+    __m128i r0 = _mm_packs_epi32( _mm_srli_epi32(acc0,RESAMPLE_BITS),
+				  _mm_srli_epi32(acc1,RESAMPLE_BITS) );
+    __m128i r1 = _mm_packs_epi32( _mm_srli_epi32(acc2,RESAMPLE_BITS),
+				  _mm_srli_epi32(acc3,RESAMPLE_BITS) );
+    _mm_storeu_si128( (__m128i*)(dst+i), _mm_packus_epi16( r0, r1 ) );
+  }
+#endif
+  for ( ; i<n; i++ ) {
+    Uint32 c = RESAMPLE_ONE/2;
+    for ( int k=0; k<taps; k++ ) {
+      c += s[k*pitch + i] * t.weights[k];
+    }
+    dst[i] = c >> RESAMPLE_BITS;
+  }
+}
 
-void Canvas::scale( int w, int h )
+Canvas* Canvas::scaled( int w, int h ) const
 {
-  if ( w!=width() && h!=height() ) {
-    SDL_Surface *s = zoomSurface( m_surface,
-				  (double)w/(double)width(),
-				  (double)h/(double)height() );
-    if ( s ) {
-      SDL_FreeSurface( m_surface );
-      m_surface = s;
+  // 32bpp formats are worked on as they are, others go through ours
+  SDL_Surface* src = m_surface;
+  if ( src->format->BytesPerPixel != 4 ) {
+    Canvas tmp( 1, 1 );
+    src = SDL_ConvertSurface( m_surface, tmp.m_surface->format, 0 );
+    if ( !src ) {
+      throw std::runtime_error( SDL_GetError() );
     }
   }
+  SDL_Surface* dst = SDL_CreateRGBSurface( 0, w, h, 32,
+					   src->format->Rmask,
+					   src->format->Gmask,
+					   src->format->Bmask,
+					   src->format->Amask );
+  if ( !dst ) {
+    throw std::runtime_error( SDL_GetError() );
+  }
+
+  std::vector<ResampleTaps> across = resampleTaps( src->w, w );
+  std::vector<ResampleTaps> down = resampleTaps( src->h, h );
+
+  // across into a scratch image of the source height, then down
+  const int rowBytes = w * 4;
+  std::vector<Uint32> wide( w * src->h );
+  SDL_LockSurface( src );
+  for ( int y=0; y<src->h; y++ ) {
+    resampleRow( (const Uint32*)((const Uint8*)src->pixels + y*src->pitch),
+		 &wide[y*w], across );
+  }
+  SDL_UnlockSurface( src );
+  SDL_LockSurface( dst );
+  for ( int y=0; y<h; y++ ) {
+    resampleColumn( (const Uint8*)&wide[0], rowBytes,
+		    (Uint8*)dst->pixels + y*dst->pitch, rowBytes, down[y] );
+  }
+  SDL_UnlockSurface( dst );
+
+  if ( src != m_surface ) {
+    SDL_FreeSurface( src );
+  }
+  Canvas* c = new Canvas( dst );
+  return c;
+}
+
+void Canvas::scale( int w, int h )
+{
+  if ( w!=width() || h!=height() ) {
+    Canvas* c = scaled( w, h );
+    std::swap( m_surface, c->m_surface );
+    delete c;
+    resetClip();
+  }
 }
 
 template <typename CoordType, typename SizeType>
@@ -432,6 +1104,28 @@ void Canvas::clear( const Rect& r )
   }
 }
 
+void Canvas::clearFaded( const Rect& r )
+{
+  if ( !m_bgImage ) {
+    drawRect( r, fadeColour(m_bgColour) );
+    return;
+  }
+  if ( !m_bgFaded || m_bgFadedFrom != m_bgImage ) {
+    delete m_bgFaded;
+    m_bgFaded = new Canvas( m_bgImage->width(), m_bgImage->height() );
+    // convert to our format first so the fade sees our pixel layout
+    SDL_FreeSurface( m_bgFaded->m_surface );
+    m_bgFaded->m_surface = SDL_ConvertSurface( m_bgImage->m_surface,
+					       m_surface->format, 0 );
+    SDL_SetSurfaceBlendMode( m_bgFaded->m_surface, SDL_BLENDMODE_NONE );
+    m_bgFaded->resetClip();
+    m_bgFaded->fade( Rect(0,0,m_bgFaded->width()-1,m_bgFaded->height()-1) );
+    m_bgFadedFrom = m_bgImage;
+  }
+  SDL_Rect srcRect = make_SDL_Rect(r.tl.x, r.tl.y, r.br.x-r.tl.x+1, r.br.y-r.tl.y+1);
+  SDL_BlitSurface( m_bgFaded->m_surface, &srcRect, m_surface, &srcRect );
+}
+
 void Canvas::drawImage( Canvas *canvas, int x, int y )
 {
   Rect dest(x,y,x+canvas->width(),y+canvas->height());
@@ -442,35 +1136,37 @@ void Canvas::drawImage( Canvas *canvas, int x, int y )
   SDL_BlitSurface( canvas->m_surface, &sdlsrc, m_surface, &sdldst );
 }
 
-void Canvas::drawPixel( int x, int y, int c )
+void Canvas::drawImage( Canvas *canvas, const Rect& src, int x, int y )
 {
-  Uint32 bpp, ofs;
+  Rect dest(x,y,x+src.width()-1,y+src.height()-1);
+  dest.clipTo(m_clip);
+  if (dest.isEmpty()) {
+    return;
+  }
 
-  bpp = m_surface->format->BytesPerPixel;
-  ofs = m_surface->pitch*y;
-  char* row = (char*)m_surface->pixels + ofs;
+  SDL_Rect sdlsrc = make_SDL_Rect(src.tl.x+dest.tl.x-x, src.tl.y+dest.tl.y-y,
+				  dest.width(), dest.height());
+  SDL_Rect sdldst = make_SDL_Rect(dest.tl.x, dest.tl.y, 0, 0);
+  SDL_BlitSurface( canvas->m_surface, &sdlsrc, m_surface, &sdldst );
+}
 
+void Canvas::drawPixel( int x, int y, int c )
+{
   SDL_LockSurface(m_surface);
-  switch ( bpp ) {
-  case 2: ((Uint16*)row)[x] = c; break;
-  case 4: ((Uint32*)row)[x] = c; break;
+  switch ( m_surface->format->BytesPerPixel ) {
+  case 2: PixelRows<Uint16>( m_surface ).at( x, y ) = c; break;
+  case 4: PixelRows<Uint32>( m_surface ).at( x, y ) = c; break;
   }
   SDL_UnlockSurface(m_surface);
 }
 
 int Canvas::readPixel( int x, int y ) const
 {
-  Uint32 bpp, ofs;
   int c;
-
-  bpp = m_surface->format->BytesPerPixel;
-  ofs = m_surface->pitch*y;
-  char* row = (char*)m_surface->pixels + ofs;
-
   SDL_LockSurface(m_surface);
-  switch ( bpp ) {
-  case 2: c = ((Uint16*)row)[x]; break;
-  case 4: c = ((Uint32*)row)[x]; break;
+  switch ( m_surface->format->BytesPerPixel ) {
+  case 2: c = PixelRows<Uint16>( m_surface ).at( x, y ); break;
+  case 4: c = PixelRows<Uint32>( m_surface ).at( x, y ); break;
   default: c=0; break;
   }
   SDL_UnlockSurface(m_surface);
@@ -478,93 +1174,101 @@ int Canvas::readPixel( int x, int y ) const
 }
 
 void Canvas::drawLine( int x1, int y1, int x2, int y2, int color )
-{  
-  int lg_delta, sh_delta, cycle, lg_step, sh_step;
-  lg_delta = x2 - x1;
-  sh_delta = y2 - y1;
-  lg_step = Sgn(lg_delta);
-  lg_delta = Abs(lg_delta);
-  sh_step = Sgn(sh_delta);
-  sh_delta = Abs(sh_delta);
-  if (sh_delta < lg_delta) {
-    cycle = lg_delta >> 1;
-    while (x1 != x2) {
-      drawPixel( x1, y1, color);
-      cycle += sh_delta;
-      if (cycle > lg_delta) {
-	cycle -= lg_delta;
-	y1 += sh_step;
-      }
-      x1 += lg_step;
-    }
-    drawPixel( x1, y1, color);
-  }
-  cycle = sh_delta >> 1;
-  while (y1 != y2) {
-    drawPixel( x1, y1, color);
-    cycle += lg_delta;
-    if (cycle > sh_delta) {
-      cycle -= sh_delta;
-      x1 += lg_step;
-    }
-    y1 += sh_step;
+{
+  SDL_LockSurface(m_surface);
+  switch ( m_surface->format->BytesPerPixel ) {
+  case 2: plotLine<Uint16>( m_surface, x1, y1, x2, y2, color ); break;
+  case 4: plotLine<Uint32>( m_surface, x1, y1, x2, y2, color ); break;
   }
-  drawPixel( x1, y1, color);
+  SDL_UnlockSurface(m_surface);
 }
 
-void Canvas::drawPath( const Path& path, int color, bool thick )
+/// draw segments first..last of path onto a locked surface, inking only
+/// pixels inside clip, which must lie within the surface
+static void drawSegments( SDL_Surface* surface, const Path& path,
+			  int first, int last, int color, bool thick,
+			  const Rect& clip, const SpanBrush32* spans )
 {
-  // allow for thick lines in clipping
-  Rect clip = m_clip;
-  clip.tl.x++; clip.tl.y++;
-  clip.br.x--; clip.br.y--;
+  // segments with both ends in here have their whole brush in clip
+  Rect inner = clip;
+  inner.grow(-1);
 
-  int i=0;
-  const int n = path.numPoints();
- 
-  for ( ; i<n && !clip.contains( path.point(i) ); i++ ) {
-    //skip clipped start pt
-  }
-  i++;
-  SDL_LockSurface(m_surface);
-  for ( ; i<n; i++ ) {
-    // pt i-1 is guranteed to be inside clipping    
+  for ( int i=first+1; i<=last; i++ ) {
+    const Vec2& p1 = path.point(i-1);
     const Vec2& p2 = path.point(i);
-    if ( clip.contains( p2 ) ) {
-      const Vec2& p1 = path.point(i-1);
-      switch ( m_surface->format->BytesPerPixel ) {
-      case 2:      
+    if ( !inner.contains( p1 ) || !inner.contains( p2 ) ) {
+      switch ( surface->format->BytesPerPixel ) {
+      case 2:
 	if ( thick ) {
-	  renderLine<Uint16,3>( m_surface->pixels,
-				m_surface->pitch,
-				p1.x, p1.y, p2.x, p2.y, color );
+	  renderLineClipped<Uint16,3>( surface->pixels, surface->pitch,
+				       p1.x, p1.y, p2.x, p2.y, color, clip );
 	} else {
-	  renderLine<Uint16,1>( m_surface->pixels,
-				m_surface->pitch,
-				p1.x, p1.y, p2.x, p2.y, color );
+	  renderLineClipped<Uint16,1>( surface->pixels, surface->pitch,
+				       p1.x, p1.y, p2.x, p2.y, color, clip );
 	}
 	break;
       case 4:
 	if ( thick ) {
-	  renderLine<Uint32,3>( m_surface->pixels,
-				m_surface->pitch,
-				p1.x, p1.y, p2.x, p2.y, color );
+	  renderLineClipped<Uint32,3>( surface->pixels, surface->pitch,
+				       p1.x, p1.y, p2.x, p2.y, color, clip );
 	} else {
-	  renderLine<Uint32,1>( m_surface->pixels,
-				m_surface->pitch,
-				p1.x, p1.y, p2.x, p2.y, color );
+	  renderLineClipped<Uint32,1>( surface->pixels, surface->pitch,
+				       p1.x, p1.y, p2.x, p2.y, color, clip );
 	}
 	break;
       }
-    } else {
-      for ( ; i<n && !clip.contains( path.point(i) ); i++ ) {
-	//skip until we find a unclipped pt - this will be p1 next
-	//time around
+      continue;
+    }
+    switch ( surface->format->BytesPerPixel ) {
+    case 2:      
+      if ( thick ) {
+	renderLine<Uint16,3>( surface->pixels,
+			      surface->pitch,
+			      p1.x, p1.y, p2.x, p2.y, color );
+      } else {
+	renderLine<Uint16,1>( surface->pixels,
+			      surface->pitch,
+			      p1.x, p1.y, p2.x, p2.y, color );
       }
+      break;
+    case 4:
+      if ( spans && thick ) {
+	renderSpans<3>( surface->pixels, surface->pitch,
+			p1.x, p1.y, p2.x, p2.y, *spans );
+      } else if ( spans ) {
+	renderSpans<1>( surface->pixels, surface->pitch,
+			p1.x, p1.y, p2.x, p2.y, *spans );
+      } else if ( thick ) {
+	renderLine<Uint32,3>( surface->pixels,
+			      surface->pitch,
+			      p1.x, p1.y, p2.x, p2.y, color );
+      } else {
+	renderLine<Uint32,1>( surface->pixels,
+			      surface->pitch,
+			      p1.x, p1.y, p2.x, p2.y, color );
+      }
+      break;
     }
   }
+}
+
+void Canvas::drawPath( const Path& path, int color, bool thick )
+{
+  Rect clip = m_clip;
+  clip.clipTo( Rect(0,0,width()-1,height()-1) );
+  if ( clip.isEmpty() ) {
+    return;
+  }
+
+  const int n = path.numPoints();
+  SpanBrush32 brush( color );
+  const SpanBrush32* spans = NULL;
+  if ( SPAN_LINES && m_surface->format->BytesPerPixel == 4 && n > 1 ) {
+    spans = &brush;
+  }
+  SDL_LockSurface(m_surface);
+  drawSegments( m_surface, path, 0, n-1, color, thick, clip, spans );
   SDL_UnlockSurface(m_surface);
-  
 }
 
 void Canvas::drawRect( int x, int y, int w, int h, int c, bool fill )
@@ -591,8 +1295,13 @@ void Canvas::drawRect( const Rect& r, int c, bool fill )
 
 
 
-Window::Window( int w, int h, const char* title, const char* winclass, bool fullscreen )
-  : m_title(title)
+Window::Window( int w, int h, const char* title, const char* winclass,
+		bool fullscreen, Present present )
+  : m_title(title ? title : ""),
+    m_present(present),
+    m_window(NULL),
+    m_renderer(NULL),
+    m_texture(NULL)
 {
   if ( winclass ) {
     char s[80];
@@ -605,17 +1314,27 @@ Window::Window( int w, int h, const char* title, const char* winclass, bool full
   SDL_ShowCursor( SDL_DISABLE );
 #endif
   
-//  int st = SDL_CreateWindowAndRenderer(0, 0, SDL_WINDOW_FULLSCREEN_DESKTOP, &m_window, &m_renderer);
-  int st = SDL_CreateWindowAndRenderer(w, h, 0, &m_window, &m_renderer);
-  if (st != 0 || m_window == NULL || m_renderer == NULL)
+  m_window = SDL_CreateWindow(m_title.c_str(), SDL_WINDOWPOS_UNDEFINED,
+			      SDL_WINDOWPOS_UNDEFINED, w, h, 0);
+  if (m_window == NULL)
       throw std::runtime_error("Failed to create window");
-  
-  m_surface = SDL_GetWindowSurface(m_window);
+
+  // a window surface and a renderer cannot share a window, so only
+  // create the renderer when presenting through it
+  if ( m_present != PRESENT_SURFACE ) {
+    Uint32 flags = m_present==PRESENT_SOFTWARE ? SDL_RENDERER_SOFTWARE : 0;
+    if ( !createRenderer( flags ) ) {
+      fprintf(stderr,"texture presentation unavailable: %s\n",SDL_GetError());
+      m_present = PRESENT_SURFACE;
+    }
+  }
+  if ( m_present == PRESENT_SURFACE ) {
+    m_surface = SDL_GetWindowSurface(m_window);
+    if (m_surface == NULL)
+      throw std::runtime_error("Failed to get window surface");
+  }
 
   resetClip();
-  
-  SDL_SetRenderDrawColor(m_renderer, 0, 0, 0, 255);
-  SDL_RenderClear(m_renderer);
 
   memset(&(Swipe::m_syswminfo), 0, sizeof(SDL_SysWMinfo));
   SDL_VERSION(&(Swipe::m_syswminfo.version));
@@ -624,6 +1343,56 @@ Window::Window( int w, int h, const char* title, const char* winclass, bool full
 }
 
 
+Window::~Window()
+{
+  if ( m_present == PRESENT_SURFACE ) {
+    // owned by the window, not us
+    m_surface = NULL;
+  }
+  if ( m_texture ) {
+    SDL_DestroyTexture(m_texture);
+  }
+  if ( m_renderer ) {
+    SDL_DestroyRenderer(m_renderer);
+  }
+  SDL_DestroyWindow(m_window);
+}
+
+
+bool Window::createRenderer( Uint32 flags )
+{
+  int w, h;
+  SDL_GetWindowSize(m_window, &w, &h);
+  m_renderer = SDL_CreateRenderer(m_window, -1, flags);
+  if ( m_renderer ) {
+    m_texture = SDL_CreateTexture(m_renderer, SDL_PIXELFORMAT_RGB888,
+				  SDL_TEXTUREACCESS_STREAMING, w, h);
+  }
+  if ( m_texture ) {
+    // drawn into here, then uploaded a dirty rect at a time
+    m_surface = SDL_CreateRGBSurface( 0, w, h, 32,
+				      0xFF0000, 0x00FF00, 0x0000FF, 0 );
+  }
+  if ( m_surface == NULL ) {
+    if ( m_texture ) {
+      SDL_DestroyTexture(m_texture);
+      m_texture = NULL;
+    }
+    if ( m_renderer ) {
+      SDL_DestroyRenderer(m_renderer);
+      m_renderer = NULL;
+    }
+    return false;
+  }
+  SDL_SetTextureBlendMode(m_texture, SDL_BLENDMODE_NONE);
+  SDL_FillRect(m_surface, NULL, 0);
+  SDL_UpdateTexture(m_texture, NULL, m_surface->pixels, m_surface->pitch);
+  SDL_RenderCopy(m_renderer, m_texture, NULL, NULL);
+  SDL_RenderPresent(m_renderer);
+  return true;
+}
+
+
 void Window::update( const Rect& r )
 {
   if ( r.tl.x < width() && r.tl.y < height() ) {
@@ -631,15 +1400,37 @@ void Window::update( const Rect& r )
     int y1 = std::max( 0, r.tl.y );
     int x2 = std::min( width()-1, r.br.x );
     int y2 = std::min( height()-1, r.br.y );
-    int w  = std::max( 0, x2-x1 );
-    int h  = std::max( 0, y2-y1 );
-    if ( w > 0 && h > 0 ) {
-	// TODO: SDL_UpdateWindowSurfaceRects(m_window, NULL, 0);
-      SDL_UpdateWindowSurface(m_window);
+    if ( x2 > x1 && y2 > y1 ) {
+      SDL_Rect rect = { x1, y1, x2-x1+1, y2-y1+1 };
+      m_dirty.push_back( rect );
+    }
+  }
+}
+
+void Window::flush()
+{
+  if ( m_dirty.empty() ) {
+    return;
+  }
+  if ( m_texture ) {
+    // upload just the dirty parts; the copy to the back buffer is
+    // whole as its previous contents are undefined
+    for ( size_t i=0; i<m_dirty.size(); i++ ) {
+      const SDL_Rect& rect = m_dirty[i];
+      Uint8* pixels = (Uint8*)m_surface->pixels
+	+ rect.y*m_surface->pitch + rect.x*m_surface->format->BytesPerPixel;
+      SDL_UpdateTexture(m_texture, &rect, pixels, m_surface->pitch);
+    }
+    SDL_RenderCopy(m_renderer, m_texture, NULL, NULL);
+    SDL_RenderPresent(m_renderer);
+  } else {
+    SDL_UpdateWindowSurfaceRects(m_window, &m_dirty[0], (int)m_dirty.size());
+  }
+  m_dirty.clear();
 #ifdef USE_HILDON
 #if MAEMO_VERSION >= 5
-      static bool captured = false;
-      if (!captured) {
+  static bool captured = false;
+  if (!captured) {
 	SDL_SysWMinfo sys;
 	SDL_VERSION( &sys.version );
 	SDL_GetWMInfo( &sys );
@@ -667,11 +1458,9 @@ void Window::update( const Rect& r )
 	XFlush (xev.xclient.display);
 	XSync (xev.xclient.display, False);
 	captured = true;
-      }
+  }
 #endif
 #endif
-    }
-  }
 }
 
 void Window::raise()
@@ -704,6 +1493,26 @@ Image::Image( const char* file, bool alpha )
 
 
 
+/// pack a row of pixels as 24 bit BMP does, blue first
+static void bmpRow( const Uint16* src, int w, Uint8* out )
+{
+  for ( int x=0; x<w; x++, out+=3 ) {
+    Uint32 p = R16G16B16_TO_RGB888( R16(src[x]), G16(src[x]), B16(src[x]) );
+    out[0] = p;
+    out[1] = p >> 8;
+    out[2] = p >> 16;
+  }
+}
+
+static void bmpRow( const Uint32* src, int w, Uint8* out )
+{
+  for ( int x=0; x<w; x++, out+=3 ) {
+    out[0] = src[x];
+    out[1] = src[x] >> 8;
+    out[2] = src[x] >> 16;
+  }
+}
+
 int Canvas::writeBMP( const char* filename ) const
 {
 #pragma pack(push,1)
@@ -739,22 +1548,475 @@ int Canvas::writeBMP( const char* filename ) const
 
   FILE *f = fopen( filename, "wb" );
   if ( f ) {
-    Uint32 bpp;
-    bpp = m_surface->format->BytesPerPixel;
-
     fwrite( &head, 14, 1, f );
     fwrite( &info, 40, 1, f );
+    std::vector<Uint8> row( w*3 );
+    SDL_LockSurface( m_surface );
     for ( int y=h-1; y>=0; y-- ) {
-      for ( int x=0; x<w; x++ ) {
-	int p = readPixel( x, y );
-	if ( bpp==2 ) {
-	  p = R16G16B16_TO_RGB888( R16(p), G16(p), B16(p) );
-	}
-	fwrite( &p, 3, 1, f );
+      switch ( m_surface->format->BytesPerPixel ) {
+      case 2: bmpRow( PixelRows<Uint16>( m_surface ).row( y ), w, &row[0] ); break;
+      case 4: bmpRow( PixelRows<Uint32>( m_surface ).row( y ), w, &row[0] ); break;
       }
+      fwrite( &row[0], w*3, 1, f );
     }
+    SDL_UnlockSurface( m_surface );
     fclose(f);
     return 1;
   }
   return 0;
 }
+
+
+
+int Canvas::writePNG( const char* filename ) const
+{
+  PngWriter png( filename, width(), height() );
+  for ( int y=0; y<height(); y++ ) {
+    png.write( *this, y );
+  }
+  return png.close() ? 1 : 0;
+}
+
+/// deflated output gathered before it goes out as an IDAT chunk
+#define PNG_IDAT_BYTES (64*1024)
+
+/// pack pixels as 8 bit RGB
+template <typename PIX>
+static void rgbRow( const PIX* src, const SDL_PixelFormat* format,
+		    int w, unsigned char* out )
+{
+  PixelChannels channels( format );
+  for ( int x=0; x<w; x++, out+=3 ) {
+    int r, g, b;
+    channels.unpack( src[x], r, g, b );
+    out[0] = r;
+    out[1] = g;
+    out[2] = b;
+  }
+}
+
+static void putBigEndian( unsigned char* p, Uint32 v )
+{
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+PngWriter::PngWriter( const char* filename, int w, int h )
+  : m_file( fopen( filename, "wb" ) ),
+    m_width( w ),
+    m_height( h ),
+    m_rows( 0 ),
+    m_filled( 0 ),
+    m_row( 1 + w*3 ),
+    m_prev( w*3 ),
+    m_zstream( NULL )
+{
+  if ( !m_file ) {
+    return;
+  }
+  static const unsigned char signature[8] = { 137, 'P', 'N', 'G', 13, 10, 26, 10 };
+  fwrite( signature, sizeof(signature), 1, m_file );
+
+  unsigned char ihdr[13];
+  putBigEndian( ihdr, w );
+  putBigEndian( ihdr+4, h );
+  ihdr[8] = 8;   // bits per channel
+  ihdr[9] = 2;   // RGB
+  ihdr[10] = 0;  // deflate
+  ihdr[11] = 0;  // adaptive filtering
+  ihdr[12] = 0;  // not interlaced
+  chunk( "IHDR", ihdr, sizeof(ihdr) );
+
+  z_stream* z = new z_stream;
+  z->zalloc = Z_NULL;
+  z->zfree = Z_NULL;
+  z->opaque = Z_NULL;
+  if ( deflateInit( z, PNG_COMPRESSION ) != Z_OK ) {
+    delete z;
+    fclose( m_file );
+    m_file = NULL;
+    return;
+  }
+  m_zstream = z;
+  // each row is filtered against the one above, which suits the
+  // gradients and paper texture we draw
+  m_row[0] = 2;
+}
+
+PngWriter::~PngWriter()
+{
+  close();
+}
+
+void PngWriter::write( const Canvas& canvas, int y, int x, int w )
+{
+  if ( !ok() || m_rows >= m_height ) {
+    return;
+  }
+  if ( w < 0 ) {
+    w = canvas.width() - x;
+  }
+  w = std::min( w, m_width - m_filled );
+  SDL_Surface* s = canvas.m_surface;
+  unsigned char* out = &m_row[1 + m_filled*3];
+  SDL_LockSurface( s );
+  switch ( s->format->BytesPerPixel ) {
+  case 2: rgbRow( PixelRows<Uint16>( s ).row( y ) + x, s->format, w, out ); break;
+  case 4: rgbRow( PixelRows<Uint32>( s ).row( y ) + x, s->format, w, out ); break;
+  default: memset( out, 0, w*3 ); break;
+  }
+  SDL_UnlockSurface( s );
+  m_filled += w;
+  if ( m_filled == m_width ) {
+    rowDone();
+  }
+}
+
+void PngWriter::fill( int colour, int w )
+{
+  if ( !ok() || m_rows >= m_height ) {
+    return;
+  }
+  w = std::min( w, m_width - m_filled );
+  unsigned char* out = &m_row[1 + m_filled*3];
+  for ( int x=0; x<w; x++, out+=3 ) {
+    out[0] = colour >> 16;
+    out[1] = colour >> 8;
+    out[2] = colour;
+  }
+  m_filled += w;
+  if ( m_filled == m_width ) {
+    rowDone();
+  }
+}
+
+void PngWriter::rowDone()
+{
+  unsigned char* row = &m_row[1];
+  for ( int i=0; i<m_width*3; i++ ) {
+    unsigned char raw = row[i];
+    row[i] = raw - m_prev[i];
+    m_prev[i] = raw;
+  }
+  z_stream* z = (z_stream*)m_zstream;
+  z->next_in = &m_row[0];
+  z->avail_in = m_row.size();
+  deflateOut( Z_NO_FLUSH );
+  m_rows++;
+  m_filled = 0;
+}
+
+void PngWriter::deflateOut( int flush )
+{
+  z_stream* z = (z_stream*)m_zstream;
+  unsigned char buf[16*1024];
+  int err;
+  do {
+    z->next_out = buf;
+    z->avail_out = sizeof(buf);
+    err = deflate( z, flush );
+    m_out.insert( m_out.end(), buf, buf + sizeof(buf) - z->avail_out );
+    if ( m_out.size() >= PNG_IDAT_BYTES ) {
+      chunk( "IDAT", &m_out[0], m_out.size() );
+      m_out.clear();
+    }
+  } while ( err == Z_OK && (z->avail_in > 0 || z->avail_out == 0
+			    || flush == Z_FINISH) );
+}
+
+void PngWriter::chunk( const char* type, const unsigned char* data, int len )
+{
+  unsigned char head[8];
+  putBigEndian( head, len );
+  memcpy( head+4, type, 4 );
+  uLong crc = crc32( 0, head+4, 4 );
+  if ( len > 0 ) {
+    crc = crc32( crc, data, len );
+  }
+  unsigned char tail[4];
+  putBigEndian( tail, crc );
+
+  fwrite( head, sizeof(head), 1, m_file );
+  if ( len > 0 ) {
+    fwrite( data, len, 1, m_file );
+  }
+  fwrite( tail, sizeof(tail), 1, m_file );
+}
+
+bool PngWriter::close()
+{
+  if ( !ok() ) {
+    return false;
+  }
+  // a short image still makes a readable file, just not a right one
+  bool complete = (m_rows == m_height);
+  while ( m_rows < m_height ) {
+    fill( 0, m_width - m_filled );
+  }
+
+  z_stream* z = (z_stream*)m_zstream;
+  z->next_in = NULL;
+  z->avail_in = 0;
+  deflateOut( Z_FINISH );
+  deflateEnd( z );
+  delete z;
+  m_zstream = NULL;
+  if ( !m_out.empty() ) {
+    chunk( "IDAT", &m_out[0], m_out.size() );
+    m_out.clear();
+  }
+  chunk( "IEND", NULL, 0 );
+
+  bool written = !ferror( m_file );
+  written = (fclose( m_file ) == 0) && written;
+  m_file = NULL;
+  return complete && written;
+}
+
+
+/// one TiledPainter::paint(): the bins and the next tile to be drawn
+struct TiledPainter::Job
+{
+  /// consecutive segments of one item falling in a tile
+  struct Run {
+    int item;
+    int first, last;  // point indices
+  };
+
+  SDL_Surface* surface;
+  const std::vector<Item>* items;
+  std::vector<SpanBrush32> palette;          // one per distinct colour
+  std::vector<const SpanBrush32*> brushes;   // each item's, or NULL
+  std::vector<Rect> tiles;
+  std::vector< std::vector<Run> > bins;
+  SDL_atomic_t next;
+
+  /// draw tiles until none are left, from as many threads as like
+  void drawTiles()
+  {
+    for (;;) {
+      int t = SDL_AtomicAdd( &next, 1 );
+      if ( t >= (int)tiles.size() ) {
+	return;
+      }
+      const std::vector<Run>& bin = bins[t];
+      for ( size_t r=0; r<bin.size(); r++ ) {
+	const Item& item = (*items)[bin[r].item];
+	drawSegments( surface, *item.path, bin[r].first, bin[r].last,
+		      item.colour, item.thick, tiles[t], brushes[bin[r].item] );
+      }
+    }
+  }
+};
+
+class TiledPainter::TileTask : public Task
+{
+ public:
+  TileTask( Job& job ) : Task(HIGH), m_job(job) {}
+  virtual void run() { m_job.drawTiles(); }
+ private:
+  Job& m_job;
+};
+
+TiledPainter::TiledPainter()
+{}
+
+TiledPainter::~TiledPainter()
+{}
+
+void TiledPainter::add( const Path& path, int colour, bool thick )
+{
+  if ( path.numPoints() > 1 ) {
+    Item item = { &path, colour, thick };
+    m_items.push_back( item );
+  }
+}
+
+bool TiledPainter::worthwhile( const Rect& area )
+{
+  return DRAW_TILE_SIZE > 0
+    && ThreadPool::get().size() > 1
+    && area.width() * area.height() >= 4 * DRAW_TILE_SIZE * DRAW_TILE_SIZE;
+}
+
+void TiledPainter::paint( Canvas& canvas, const Rect& area )
+{
+  Rect clip = area;
+  clip.clipTo( canvas.m_clip );
+  clip.clipTo( Rect(0,0,canvas.width()-1,canvas.height()-1) );
+  if ( clip.isEmpty() || m_items.empty() ) {
+    m_items.clear();
+    return;
+  }
+
+  int size = DRAW_TILE_SIZE > 0 ? DRAW_TILE_SIZE : INT_MAX/2;
+  int cols = (clip.width() + size-1) / size;
+  int rows = (clip.height() + size-1) / size;
+  std::vector< std::vector<Job::Run> > bins( cols*rows );
+
+  Job job;
+  job.surface = canvas.m_surface;
+  job.items = &m_items;
+  for ( size_t k=0; k<m_items.size(); k++ ) {
+    const Path& path = *m_items[k].path;
+    for ( int i=1; i<path.numPoints(); i++ ) {
+      // the brush reaches two pixels past the segment
+      const Vec2& p1 = path.point(i-1);
+      const Vec2& p2 = path.point(i);
+      Rect r( std::min(p1.x,p2.x)-2, std::min(p1.y,p2.y)-2,
+	      std::max(p1.x,p2.x)+2, std::max(p1.y,p2.y)+2 );
+      r.clipTo( clip );
+      if ( r.isEmpty() ) {
+	continue;
+      }
+      for ( int ty=(r.tl.y-clip.tl.y)/size; ty<=(r.br.y-clip.tl.y)/size; ty++ ) {
+	for ( int tx=(r.tl.x-clip.tl.x)/size; tx<=(r.br.x-clip.tl.x)/size; tx++ ) {
+	  std::vector<Job::Run>& bin = bins[ty*cols+tx];
+	  if ( !bin.empty() && bin.back().item == (int)k
+	       && bin.back().last == i-1 ) {
+	    bin.back().last = i;
+	  } else {
+	    Job::Run run = { (int)k, i-1, i };
+	    bin.push_back( run );
+	  }
+	}
+      }
+    }
+  }
+
+  // only tiles with something in them are worth a thread's time
+  for ( int ty=0; ty<rows; ty++ ) {
+    for ( int tx=0; tx<cols; tx++ ) {
+      if ( bins[ty*cols+tx].empty() ) {
+	continue;
+      }
+      Rect tile( clip.tl.x + tx*size, clip.tl.y + ty*size, 0, 0 );
+      tile.br = Vec2( std::min(tile.tl.x+size-1, clip.br.x),
+		      std::min(tile.tl.y+size-1, clip.br.y) );
+      job.tiles.push_back( tile );
+      job.bins.push_back( std::vector<Job::Run>() );
+      job.bins.back().swap( bins[ty*cols+tx] );
+    }
+  }
+
+  job.brushes.resize( m_items.size(), NULL );
+  if ( SPAN_LINES && canvas.m_surface->format->BytesPerPixel == 4 ) {
+    // a level has a handful of colours across all its strokes
+    std::map<int,int> colours;
+    std::vector<int> which( m_items.size() );
+    for ( size_t k=0; k<m_items.size(); k++ ) {
+      std::map<int,int>::iterator c = colours.find( m_items[k].colour );
+      if ( c == colours.end() ) {
+	c = colours.insert( std::make_pair( m_items[k].colour,
+					    (int)job.palette.size() ) ).first;
+	job.palette.push_back( SpanBrush32( m_items[k].colour ) );
+      }
+      which[k] = c->second;
+    }
+    for ( size_t k=0; k<m_items.size(); k++ ) {
+      job.brushes[k] = &job.palette[which[k]];
+    }
+  }
+  SDL_AtomicSet( &job.next, 0 );
+
+  // the surface is locked once here as locking is not thread safe
+  SDL_LockSurface( canvas.m_surface );
+  std::vector<TileTask*> helpers;
+  if ( DRAW_TILE_SIZE > 0 ) {
+    ThreadPool& pool = ThreadPool::get();
+    int n = std::min( pool.size(), (int)job.tiles.size()-1 );
+    for ( int i=0; i<n; i++ ) {
+      helpers.push_back( new TileTask( job ) );
+      pool.submit( helpers.back() );
+    }
+  }
+  // this thread takes tiles too, so all get drawn even if the helpers
+  // never start, eg when called from a busy worker
+  job.drawTiles();
+  for ( size_t i=0; i<helpers.size(); i++ ) {
+    helpers[i]->cancel();
+    helpers[i]->wait();
+    delete helpers[i];
+  }
+  SDL_UnlockSurface( canvas.m_surface );
+  m_items.clear();
+}
+
+
+
+bool SpriteCache::Key::operator<( const Key& o ) const
+{
+  // owner first so forget() finds an owner's sprites together
+  if ( owner != o.owner ) return owner < o.owner;
+  if ( angle != o.angle ) return angle < o.angle;
+  if ( colour != o.colour ) return colour < o.colour;
+  return thick < o.thick;
+}
+
+SpriteCache::SpriteCache( int maxBytes )
+  : m_cache( maxBytes ),
+    m_added( 0 )
+{}
+
+bool SpriteCache::draw( Canvas& canvas, const Key& key, const Vec2& pos )
+{
+  const Sprite* s = m_cache.find( key );
+  if ( !s ) {
+    return false;
+  }
+  canvas.drawImage( s->canvas, Rect(0,0,s->canvas->width()-1,s->canvas->height()-1),
+		    pos.x + s->origin.x, pos.y + s->origin.y );
+  return true;
+}
+
+void SpriteCache::add( const Key& key, const Path& path )
+{
+  if ( m_cache.maxBytes() <= 0 || path.numPoints() < 2
+       || m_cache.contains( key ) ) {
+    return;
+  }
+
+  // the brush reaches up to two pixels beyond the path
+  Rect r = path.bbox();
+  r.grow( 2 );
+  Path local = path;
+  local.translate( -r.tl );
+
+  // white on black leaves the combined coverage in every channel
+  Canvas* sprite = new Canvas( r.width(), r.height() );
+  sprite->clear();
+  sprite->drawPath( local, sprite->makeColour(0xffffff), key.thick );
+
+  SDL_Surface* s = sprite->m_surface;
+  SDL_LockSurface( s );
+  for ( int y=0; y<s->h; y++ ) {
+    Uint32* row = (Uint32*)((char*)s->pixels + y*s->pitch);
+    for ( int x=0; x<s->w; x++ ) {
+      Uint32 coverage = B32( row[x] );
+      row[x] = SDL_MapRGBA( s->format, R32(key.colour), G32(key.colour),
+			    B32(key.colour), coverage );
+    }
+  }
+  SDL_UnlockSurface( s );
+  SDL_SetSurfaceBlendMode( s, SDL_BLENDMODE_BLEND );
+
+  // never evicts the sprite just made
+  m_added++;
+  m_cache.insert( key, new Sprite( sprite, r.tl ), s->pitch * s->h );
+}
+
+void SpriteCache::forget( const void* owner )
+{
+  Key first = { owner, INT_MIN, INT_MIN, false };
+  Key last = { owner, INT_MAX, INT_MAX, true };
+  m_cache.erase( first, last );
+}
+
+SpriteCache& SpriteCache::instance()
+{
+  static SpriteCache cache;
+  return cache;
+}
+
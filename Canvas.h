@@ -18,7 +18,11 @@
 #define CANVAS_H
 
 #include "Common.h"
+#include "Config.h"
+#include "LruCache.h"
 #include <string>
+#include <vector>
+#include <cstdio>
 #include <SDL.h>
 
 class Path;
@@ -38,10 +42,22 @@ public:
   void setBackground( Canvas* bg );
   void clear();
   void clear( const Rect& r );
+  /// clear r to what fade() would leave the background as, in one blit
+  void clearFaded( const Rect& r );
   void fade( const Rect& r );
+  /// @return colour c as fade() would leave it
+  int  fadeColour( int c ) const;
   Canvas* scale( int factor ) const;
+  /// @return a new canvas of our size and pixel format that copies
+  /// straight over us when drawn or used as background
+  Canvas* compatible() const;
+  /// @return a new canvas of w x h resampled from this one, bilinear
+  /// along axes that grow and averaging along those that shrink
+  Canvas* scaled( int w, int h ) const;
   void scale( int w, int h );
   void drawImage( Canvas *canvas, int x, int y );
+  /// draw just the src part of canvas with its top left at x,y
+  void drawImage( Canvas *canvas, const Rect& src, int x, int y );
   void drawPixel( int x, int y, int c );
   int  readPixel( int x, int y ) const;
   void drawLine( int x1, int y1, int x2, int y2, int c );
@@ -49,25 +65,48 @@ public:
   void drawRect( int x, int y, int w, int h, int c, bool fill=true );
   void drawRect( const Rect& r, int c, bool fill=true );
   int writeBMP( const char* filename ) const;
+  /// write as a compressed PNG, see PngWriter
+  int writePNG( const char* filename ) const;
 protected:
+  friend class SpriteCache;
+  friend class TiledPainter;
+  friend class PngWriter;
   Canvas( SDL_Surface* surface=NULL );
   SDL_Surface*   m_surface;
   int     m_bgColour;
   Canvas* m_bgImage; 
+  Canvas* m_bgFaded;      // m_bgImage pre-faded
+  Canvas* m_bgFadedFrom;  // the m_bgImage m_bgFaded was made from
   Rect    m_clip;
 };
 
 class Window : public Canvas
 {
  public:
-  Window( int w, int h, const char* title=NULL, const char* winclass=NULL, bool fullscreen=false );
+  /// how drawing reaches the screen
+  enum Present {
+    PRESENT_SURFACE,  // window surface, SDL_UpdateWindowSurface
+    PRESENT_TEXTURE,  // streaming texture on the default renderer
+    PRESENT_SOFTWARE  // streaming texture on the software renderer
+  };
+  Window( int w, int h, const char* title=NULL, const char* winclass=NULL,
+	  bool fullscreen=false, Present present=PRESENT_SURFACE );
+  ~Window();
+  /// note r as changed, to go to the screen with the next flush()
   void update( const Rect& r );
+  /// show everything update() has noted since the last flush()
+  void flush();
   void raise();
+  Present present() const { return m_present; }
  protected:
   std::string m_title;
 private:
+    bool createRenderer( Uint32 flags );
+    Present m_present;
     SDL_Window* m_window;
     SDL_Renderer* m_renderer;
+    SDL_Texture* m_texture;
+    std::vector<SDL_Rect> m_dirty;
 };
 
 
@@ -78,4 +117,138 @@ class Image : public Canvas
 };
 
 
+/**
+ * @brief 24 bit PNG written out a row at a time
+ *
+ * Rows are filtered and deflated as they arrive so only the compressed
+ * output in flight is held, whatever the image size. Rows may come from
+ * different canvases, eg a sheet of thumbnails side by side.
+ */
+class PngWriter
+{
+ public:
+  PngWriter( const char* filename, int w, int h );
+  /// finishes the file if close() was not called
+  ~PngWriter();
+
+  /// @return false if the file could not be written
+  bool ok() const { return m_file != NULL; }
+  /// append row y of canvas from x to the row being built, moving on
+  /// to the next row once it is w pixels wide
+  void write( const Canvas& canvas, int y, int x=0, int w=-1 );
+  /// pad the current row with colour 0xRRGGBB for w pixels
+  void fill( int colour, int w );
+  /// finish the file
+  /// @return true if every row was given and all went to disk
+  bool close();
+
+ private:
+  void rowDone();
+  void deflateOut( int flush );
+  void chunk( const char* type, const unsigned char* data, int len );
+
+  FILE*  m_file;
+  int    m_width;
+  int    m_height;
+  int    m_rows;
+  int    m_filled;                 // pixels of the current row so far
+  std::vector<unsigned char> m_row;   // filter byte then RGB
+  std::vector<unsigned char> m_prev;  // unfiltered previous row
+  std::vector<unsigned char> m_out;   // deflated, not yet written
+  void*  m_zstream;
+};
+
+
+/**
+ * @brief Batch of paths rasterized in screen tiles on the ThreadPool
+ *
+ * Path segments are binned into square tiles of DRAW_TILE_SIZE and each
+ * tile is drawn by one thread clipped to itself, so no two threads touch
+ * the same pixel. Within a tile segments are drawn in the order added,
+ * leaving exactly what drawPath() of each path in turn, clipped to the
+ * painted area, would have.
+ */
+class TiledPainter
+{
+ public:
+  TiledPainter();
+  ~TiledPainter();
+
+  /// queue path, which must stay unchanged until paint()
+  void add( const Path& path, int colour, bool thick );
+  /// draw everything queued within area and the canvas clip, then empty
+  /// the batch
+  void paint( Canvas& canvas, const Rect& area );
+  int size() const { return (int)m_items.size(); }
+
+  /// @return true if area is big enough to be worth splitting up
+  static bool worthwhile( const Rect& area );
+
+ private:
+  struct Item {
+    const Path* path;
+    int colour;
+    bool thick;
+  };
+  struct Job;
+  class TileTask;
+  std::vector<Item> m_items;
+};
+
+
+/**
+ * @brief Anti-aliased paths kept as alpha sprites to blit rather than
+ * rasterize again
+ *
+ * Meant for shapes that move about but rarely change, such as strokes
+ * on falling bodies. Each orientation the owner is drawn in is its own
+ * sprite, so owners pick how finely to quantize their angle.
+ */
+class SpriteCache
+{
+ public:
+  struct Key {
+    const void* owner;
+    int angle;    // quantized, in whatever steps the owner uses
+    int colour;   // 0xRRGGBB
+    bool thick;
+    bool operator<( const Key& o ) const;
+  };
+
+  SpriteCache( int maxBytes=SPRITE_CACHE_BYTES );
+
+  /// draw the sprite for key with its origin at pos
+  /// @return false if there is no such sprite yet, see add()
+  bool draw( Canvas& canvas, const Key& key, const Vec2& pos );
+  /// rasterize path, relative to the sprite origin, as the sprite for key
+  void add( const Key& key, const Path& path );
+  /// drop every sprite of owner, eg when it changes shape or goes away
+  void forget( const void* owner );
+  void clear() { m_cache.clear(); }
+
+  /// cap on sprite memory, 0 to disable caching
+  void maxBytes( int bytes ) { m_cache.maxBytes( bytes ); }
+  int maxBytes() const { return m_cache.maxBytes(); }
+  int hits() const { return m_cache.hits(); }
+  int misses() const { return m_cache.misses(); }
+  int bytes() const { return m_cache.bytes(); }
+  int size() const { return m_cache.size(); }
+  /// @return number of sprites rasterized by add()
+  int added() const { return m_added; }
+
+  /// cache shared by the scenes
+  static SpriteCache& instance();
+
+ private:
+  struct Sprite {
+    Sprite( Canvas* c, const Vec2& o ) : canvas(c), origin(o) {}
+    ~Sprite() { delete canvas; }
+    Canvas* canvas;
+    Vec2 origin;  // sprite top left relative to the path origin
+  };
+  LruCache<Key,Sprite> m_cache;
+  int m_added;
+};
+
+
 #endif //CANVAS_H
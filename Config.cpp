@@ -23,6 +23,10 @@ const Rect BOUNDS_RECT( -WORLD_WIDTH/4, -WORLD_HEIGHT,
 			WORLD_WIDTH*5/4, WORLD_HEIGHT );
 int SCREEN_WIDTH = WORLD_WIDTH;
 int SCREEN_HEIGHT = WORLD_HEIGHT;
+int STATE_HASH_TICKS = 0;
+bool SIMULATION_THREAD = false;
+bool SPAN_LINES = true;
+int DRAW_TILE_SIZE = 128;
 
 const int brushColours[] = {
   0xb80000, //red
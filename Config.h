@@ -54,9 +54,19 @@
 #endif
 
 #define ITERATION_TIMESTEPf  (1.0f / (float)ITERATION_RATE)
+#define IDLE_VELOCITY_ITERATIONS 3
+#define IDLE_POSITION_ITERATIONS 2
+#define CONTACTS_PER_SUBSTEP 32
+// beyond this the main loop drops simulation time rather than falling behind
+#define MAX_TICKS_PER_FRAME (ITERATION_RATE/MIN_RENDER_RATE)
+#define IDLE_WAIT_MS 250 // max block on input when nothing is moving
 
 #define HIDE_STEPS (AVG_RENDER_RATE*4)
 
+#define REPLAY_KEYFRAME_TICKS (ITERATION_RATE*2)
+#define REPLAY_SEEK_TICKS     (ITERATION_RATE*5)
+#define REPLAY_SEEK_STEPS     (ITERATION_RATE/4) // per tick while seeking
+
 
 #ifndef INSTALL_BASE_PATH
 # if MAEMO_VERSION >= 5
@@ -89,9 +99,16 @@
 #define SEND_TEMP_FILE "/tmp/mailto:numptyphysics@gmail.com.nph"
 
 #define ICON_SCALE_FACTOR 6
+#define TEXT_CACHE_BYTES (4*1024*1024) // rendered strings kept for reuse
+#define SPRITE_CACHE_BYTES (8*1024*1024) // rasterized moving strokes
+#define THUMBNAIL_CACHE_BYTES (4*1024*1024) // level chooser icons
+
+#define PNG_COMPRESSION 3  // zlib level for thumbnails and frames, speed over size
+#define SHEET_COLUMNS 8    // thumbnails across a -sheet
 
 #define VIDEO_FPS 20
 #define VIDEO_MAX_LEN 20  //seconds
+#define VIDEO_MAX_SPEED 16 //ticks multiplier for "-speed 0" videos
 
 
 
@@ -99,6 +116,10 @@ extern Rect FULLSCREEN_RECT;
 extern const Rect BOUNDS_RECT;
 extern int SCREEN_WIDTH;
 extern int SCREEN_HEIGHT;
+extern int STATE_HASH_TICKS; // record a state hash every N ticks, 0 = off
+extern bool SIMULATION_THREAD; // step game scenes on their own thread
+extern bool SPAN_LINES; // ink 32bpp lines a run at a time, false = per pixel
+extern int DRAW_TILE_SIZE; // big redraws rasterize in tiles this wide on the ThreadPool, 0 = serial
 extern const int brushColours[];
 extern const int NUM_BRUSHES;
 #define RED_BRUSH       0
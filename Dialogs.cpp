@@ -21,6 +21,10 @@
 #include "Config.h"
 #include "Game.h"
 #include "Scene.h"
+#include "Worker.h"
+#include "LruCache.h"
+#include <set>
+#include <stdexcept>
 
 
 /* See Swipe.h */
@@ -84,23 +88,225 @@ public:
   }
 };
 
+/// a level drawn and scaled down to an icon, with its name
+struct Thumbnail
+{
+  Thumbnail() : canvas(NULL) {}
+  ~Thumbnail() { delete canvas; }
+  Canvas* canvas;
+  std::string name;
+};
+
+/// finished thumbnails by level index, see cancelLevelThumbnails()
+static LruCache<int,Thumbnail>& thumbnails()
+{
+  static LruCache<int,Thumbnail> cache( THUMBNAIL_CACHE_BYTES );
+  return cache;
+}
+
+class ThumbnailTask;
+/// every ThumbnailTask in existence, only touched on the main thread
+static std::set<ThumbnailTask*>& thumbnailTasks()
+{
+  static std::set<ThumbnailTask*> tasks;
+  return tasks;
+}
+
+/// draws a Thumbnail on the pool
+class ThumbnailTask : public Task
+{
+  Levels* m_levels;
+  int m_level;
+  Thumbnail* m_thumb;
+public:
+  ThumbnailTask(Levels* levels, int level)
+    : m_levels(levels),
+      m_level(level),
+      m_thumb(NULL)
+  {
+    thumbnailTasks().insert(this);
+  }
+  ~ThumbnailTask()
+  {
+    // run() uses our members, so it must be over before they go
+    cancel();
+    wait();
+    delete m_thumb;
+    thumbnailTasks().erase(this);
+  }
+  int level() const { return m_level; }
+  /// @return the finished thumbnail, now the caller's, or NULL
+  Thumbnail* take()
+  {
+    Thumbnail* t = m_thumb;
+    m_thumb = NULL;
+    return t;
+  }
+  void run()
+  {
+    try {
+      Scene scene( true );
+      unsigned char buf[64*1024];
+      int size = m_levels->load( m_level, buf, sizeof(buf) );
+      if ( size && !cancelRequested() && scene.load( buf, size ) ) {
+	Canvas temp( SCREEN_WIDTH, SCREEN_HEIGHT );
+	scene.draw( temp, FULLSCREEN_RECT );
+	Thumbnail* t = new Thumbnail;
+	t->canvas = temp.scale( ICON_SCALE_FACTOR );
+	t->name = m_levels->levelName( m_level );
+	m_thumb = t;
+      }
+    } catch ( const std::exception& e ) {
+      // a broken level keeps its placeholder
+    } catch ( const char* e ) {
+    }
+  }
+};
+
+void cancelLevelThumbnails()
+{
+  std::set<ThumbnailTask*>& tasks = thumbnailTasks();
+  for (std::set<ThumbnailTask*>::iterator i=tasks.begin(); i!=tasks.end(); ++i) {
+    (*i)->cancel();
+    (*i)->wait();
+    // drawn from the old numbering, so don't let it be cached
+    delete (*i)->take();
+  }
+  thumbnails().clear();
+}
+
+/// thumbnails of the levels in one collection, drawn on the pool as they
+/// scroll in and kept for the next time they are shown
+class LevelGrid : public GridView
+{
+  Levels* m_levels;
+  int m_collection;
+  int m_current;
+  struct Pending {
+    Widget* cell;  // NULL once the cell shows something else
+    ThumbnailTask* task;
+  };
+  std::vector<Pending> m_pending;
+
+  static void show(IconButton* thumb, const Thumbnail* t)
+  {
+    // the cached canvas may be evicted while shown, so blit a copy
+    Canvas* c = t->canvas->compatible();
+    c->drawImage( t->canvas, 0, 0 );
+    thumb->text( t->name );
+    thumb->canvas( c );
+  }
+
+  /// stop waiting on a thumbnail for whatever cell showed before
+  void detach(Widget* cell)
+  {
+    for (size_t i=0; i<m_pending.size(); i++) {
+      if (m_pending[i].cell == cell) {
+	if (m_pending[i].task->cancel()) {
+	  delete m_pending[i].task;
+	  m_pending.erase(m_pending.begin()+i);
+	} else {
+	  // already drawing, it is still worth keeping
+	  m_pending[i].cell = NULL;
+	}
+	return;
+      }
+    }
+  }
+
+public:
+  LevelGrid(Levels* levels, int collection, int current)
+    : GridView(Vec2(SCREEN_WIDTH/ICON_SCALE_FACTOR,
+		    SCREEN_HEIGHT/ICON_SCALE_FACTOR+30),
+	       Vec2(10,10)),
+      m_levels(levels),
+      m_collection(collection),
+      m_current(current)
+  {}
+  ~LevelGrid()
+  {
+    for (size_t i=0; i<m_pending.size(); i++) {
+      delete m_pending[i].task;
+    }
+  }
+  void onTick(int tick)
+  {
+    for (size_t i=0; i<m_pending.size(); ) {
+      ThumbnailTask* task = m_pending[i].task;
+      if (!task->done()) {
+	i++;
+	continue;
+      }
+      Thumbnail* t = task->take();
+      if (t && thumbnails().contains(task->level())) {
+	// drawn twice, eg scrolled away and back while drawing
+	delete t;
+	t = thumbnails().find(task->level());
+      } else if (t) {
+	thumbnails().insert(task->level(), t,
+			    t->canvas->width()*t->canvas->height()*4);
+      }
+      if (t && m_pending[i].cell) {
+	show((IconButton*)m_pending[i].cell, t);
+      }
+      delete task;
+      m_pending.erase(m_pending.begin()+i);
+    }
+    GridView::onTick(tick);
+  }
+  bool isIdle()
+  {
+    // keep ticking until every thumbnail has been picked up
+    return m_pending.empty() && GridView::isIdle();
+  }
+protected:
+  int count()
+  {
+    return m_levels->collectionSize(m_collection);
+  }
+  Widget* createCell()
+  {
+    IconButton* thumb = new IconButton("--","",Event::NOP);
+    thumb->font(Font::blurbFont());
+    thumb->setBg(SELECTED_BG);
+    thumb->border(false);
+    return thumb;
+  }
+  void bindCell(Widget* cell, int i)
+  {
+    IconButton* thumb = (IconButton*)cell;
+    int level = m_levels->collectionLevel(m_collection,i);
+    thumb->event(Event(Event::PLAY,level));
+    thumb->transparent(i!=m_current);
+    detach(cell);
+
+    const Thumbnail* t = thumbnails().find(level);
+    if (t) {
+      show(thumb, t);
+      return;
+    }
+    // placeholder until the pool has drawn it, see onTick()
+    thumb->text("--");
+    thumb->canvas(NULL);
+    Pending p;
+    p.cell = cell;
+    p.task = new ThumbnailTask(m_levels, level);
+    ThreadPool::get().submit(p.task);
+    m_pending.push_back(p);
+  }
+};
+
 class LevelSelector : public MenuPage
 {
-  static const int THUMB_COUNT = 32;
   GameControl* m_game;
   Levels* m_levels;
   int m_collection;
-  int m_dispbase;
-  int m_dispcount;
-  IconButton* m_thumbs[THUMB_COUNT];
   ScrollArea* m_scroll;
 public:
   LevelSelector(GameControl* game, int initialLevel)
     : m_game(game),
       m_levels(game->m_levels),
-      m_collection(0),
-      m_dispbase(0),
-      m_dispcount(0)
+      m_collection(0)
   {
     m_scroll = new ScrollArea();
     m_scroll->fitToParent(true);
@@ -119,9 +325,11 @@ public:
       return;
     }    
     m_collection = c;
-    m_dispbase = 0;
-    m_dispcount = m_levels->collectionSize(c);
-    m_scroll->virtualSize(Vec2(SCREEN_WIDTH,150+(SCREEN_HEIGHT/ICON_SCALE_FACTOR+40)*((m_dispcount+2)/3)));
+    LevelGrid *grid = new LevelGrid(m_levels, c, levelInC);
+    grid->viewport(m_scroll);
+    grid->sizeTo(Vec2(SCREEN_WIDTH,0));
+    int gridh = grid->contentHeight();
+    m_scroll->virtualSize(Vec2(SCREEN_WIDTH,84+gridh+110));
 
     m_scroll->empty();
     Box *vbox = new VBox();
@@ -141,44 +349,9 @@ public:
     hbox->add( w, BUTTON_WIDTH, 0 );
     vbox->add( hbox, 64, 0 );
     vbox->add( new Spacer(),  10, 0 );
-
-    hbox = new HBox();
-    hbox->add( new Spacer(),  0, 1 );
-    int accumw = 0;
-    for (int i=0; i<m_dispcount; i++) {
-      accumw += SCREEN_WIDTH / ICON_SCALE_FACTOR + 10;
-      if (accumw >= SCREEN_WIDTH) {
-	vbox->add(hbox, SCREEN_HEIGHT/ICON_SCALE_FACTOR+30, 4);
-	vbox->add( new Spacer(),  10, 0 );
-	hbox = new HBox();
-	hbox->add( new Spacer(),  0, 1 );
-	accumw = SCREEN_WIDTH / ICON_SCALE_FACTOR;
-      }
-      m_thumbs[i] = new IconButton("--","",Event(Event::PLAY, //SELECT,
-						 m_levels->collectionLevel(c,i)));
-      m_thumbs[i]->font(Font::blurbFont());
-      m_thumbs[i]->setBg(SELECTED_BG);
-      m_thumbs[i]->border(false);
-      hbox->add( m_thumbs[i],  SCREEN_WIDTH / ICON_SCALE_FACTOR, 0 );
-      hbox->add( new Spacer(), 0, 1 );
-    }
-    vbox->add(hbox, SCREEN_HEIGHT/ICON_SCALE_FACTOR+30, 4);
+    vbox->add( grid, gridh, 0 );
     vbox->add( new Spacer(), 110, 10 );
     m_scroll->add(vbox,0,0);
-
-    for (int i=0; i<THUMB_COUNT && i+m_dispbase<m_dispcount; i++) {
-      Canvas temp( SCREEN_WIDTH, SCREEN_HEIGHT );
-      Scene scene( true );
-      unsigned char buf[64*1024];
-      int level = m_levels->collectionLevel(c,i);
-      int size = m_levels->load( level, buf, sizeof(buf) );
-      if ( size && scene.load( buf, size ) ) {
-	scene.draw( temp, FULLSCREEN_RECT );
-	m_thumbs[i]->text( m_levels->levelName(level) );
-	m_thumbs[i]->canvas( temp.scale( ICON_SCALE_FACTOR ) );
-	m_thumbs[i]->transparent(m_dispbase+i!=levelInC);
-      }
-    }
   }
   bool onEvent(Event& ev)
   {
@@ -189,16 +362,6 @@ public:
     case Event::NEXT:
       setCollection(m_collection+1,0);
       return true;
-//     case Event::SELECT:
-//       for (int i=0; i<THUMB_COUNT && i+m_dispbase<m_dispcount; i++) {
-// 	m_thumbs[i]->transparent(true);
-//       }
-//       m_thumbs[m_dispbase+ev.x]->transparent(false);
-//       m_game->gotoLevel(m_levels->collectionLevel(m_collection,m_dispbase+ev.x));
-//       add( new LevelLauncher(m_levels->collectionLevel(m_collection,m_dispbase+ev.x), m_thumbs[m_dispbase+ev.x]->canvas()) );
-//       //Event closeEvent(Event::CLOSE);
-//       //m_parent->dispatchEvent(closeEvent);
-//       return true;
     default:
       return MenuPage::onEvent(ev);
     }
@@ -715,3 +878,52 @@ Widget *createEditDoneDialog( GameControl* game )
   return new EditDoneDialog(game);
 }
 
+
+class UploadDialog : public Dialog
+{
+  GameControl* m_game;
+  Label*       m_status;
+  int          m_percent;
+public:
+  UploadDialog(GameControl* game)
+    : Dialog("Uploading",Event::NOP,Event::CANCEL),
+      m_game(game),
+      m_percent(-1)
+  {
+    Box *vbox = new VBox();
+    vbox->add(new Spacer(),10,1);
+    m_status = new Label("sending...");
+    vbox->add(m_status,20,0);
+    vbox->add(new Spacer(),10,1);
+    content()->add(vbox,0,0);
+    m_targetPos = Vec2( 150, 70);
+    sizeTo(Vec2(500,160));
+  }
+  void onTick( int tick )
+  {
+    int percent = m_game->sendProgress();
+    if (percent != m_percent && percent >= 0) {
+      m_percent = percent;
+      char buf[32];
+      sprintf(buf,"sending... %d%%",percent);
+      m_status->text(buf);
+    }
+    Dialog::onTick(tick);
+  }
+  bool onEvent( Event& ev )
+  {
+    if (ev.code == Event::CANCEL) {
+      m_game->cancelSend();
+      close();
+      return true;
+    }
+    return Dialog::onEvent(ev);
+  }
+};
+
+
+Widget *createUploadDialog( GameControl* game )
+{
+  return new UploadDialog(game);
+}
+
@@ -31,6 +31,11 @@ Widget* createToolDialog(GameControl* game);
 Widget *createIconDialog( const std::string &title, const MenuItem* items );
 Widget *createNextLevelDialog( GameControl* game );
 Widget *createEditDoneDialog( GameControl* game );
+Widget *createUploadDialog( GameControl* game );
+
+/// Stop drawing level chooser thumbnails and forget those drawn, as level
+/// indices may move. Must be done before the Levels are modified.
+void cancelLevelThumbnails();
 
 
 #endif //DIALOG_H
@@ -21,6 +21,8 @@
 
 // custom SDL User Event code
 const int WORKER_DONE = 1;
+const int HTTP_PROGRESS = 2; // data1=HttpUpload, data2=percent sent
+const int HTTP_DONE = 3;     // data1=HttpUpload
 
 struct Event
 {
@@ -54,6 +56,8 @@ struct Event
     PAUSE,
     PLAY,
     REPLAY,
+    REWIND,
+    FORWARD,
     SAVE,
     SEND,
     TEXT
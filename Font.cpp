@@ -19,28 +19,129 @@
 #include <SDL_ttf.h>
 
 
+#define ATLAS_WIDTH 512
+
+
 struct FontCanvas : public Canvas
 {
   FontCanvas( SDL_Surface* s )
     : Canvas( s )
   {}
+  FontCanvas( int w, int h )
+    : Canvas( w, h )
+  {}
+  /// copy pixels and alpha as they are rather than blending
+  void place( FontCanvas* glyph, int x, int y )
+  {
+    SDL_SetSurfaceBlendMode( glyph->m_surface, SDL_BLENDMODE_NONE );
+    drawImage( glyph, x, y );
+  }
+  void tint( int colour )
+  {
+    SDL_SetSurfaceColorMod( m_surface, (colour>>16)&0xff,
+			    (colour>>8)&0xff, colour&0xff );
+  }
 };
 
 
 Font::Font( const std::string& file, int ptsize )
+  : m_atlas( NULL )
 {
   TTF_Init();
   std::string fname = Config::findFile(file);
   m_ttf_font = TTF_OpenFont( fname.c_str(), ptsize );
+  m_lineHeight = TTF_FontHeight( m_ttf_font );
+  for ( int c=0; c<256; c++ ) {
+    m_glyphs[c].cached = false;
+  }
   m_height = metrics("M").y;
 }
 
+Font::~Font()
+{
+  delete m_atlas;
+}
+
+
+const Font::Glyph& Font::glyph( unsigned char c ) const
+{
+  Glyph& g = m_glyphs[c];
+  if ( g.cached ) {
+    return g;
+  }
+  g.cached = true;
+  g.src.clear();
+
+  int maxx, miny, maxy;
+  if ( TTF_GlyphMetrics( m_ttf_font, c, &g.minx, &maxx,
+			 &miny, &maxy, &g.advance ) != 0 ) {
+    g.minx = g.advance = 0;
+    return g;
+  }
+  // rendered as a one character string, like whole strings used to be,
+  // so it has the full line height and starts left of the pen only for
+  // glyphs that overhang it
+  g.minx = g.minx < 0 ? g.minx : 0;
+
+  char str[2] = { (char)c, 0 };
+  SDL_Color white = { 255, 255, 255 };
+  SDL_Surface* s = c > ' ' ? TTF_RenderText_Blended( m_ttf_font, str, white ) : NULL;
+  if ( !s ) {
+    return g;
+  }
+  FontCanvas rendered( s );
+  int w = rendered.width(), h = rendered.height();
+
+  // shelf packing, one row of font height at a time
+  if ( m_atlasPen.x + w > ATLAS_WIDTH ) {
+    m_atlasPen = Vec2( 0, m_atlasPen.y + m_lineHeight );
+  }
+  if ( !m_atlas || m_atlasPen.y + h > m_atlas->height() ) {
+    int rows = m_atlas ? 2 * m_atlas->height() / m_lineHeight : 4;
+    FontCanvas* bigger = new FontCanvas( ATLAS_WIDTH, rows * m_lineHeight );
+    if ( m_atlas ) {
+      bigger->place( m_atlas, 0, 0 );
+      delete m_atlas;
+    }
+    m_atlas = bigger;
+  }
+  m_atlas->place( &rendered, m_atlasPen.x, m_atlasPen.y );
+  g.src = Rect( m_atlasPen.x, m_atlasPen.y,
+		m_atlasPen.x + w - 1, m_atlasPen.y + h - 1 );
+  m_atlasPen.x += w;
+  return g;
+}
+
+
+int Font::kerning( unsigned char prev, unsigned char c ) const
+{
+#ifdef SDL_TTF_VERSION_ATLEAST
+#if SDL_TTF_VERSION_ATLEAST(2,0,14)
+  if ( prev ) {
+    return TTF_GetFontKerningSizeGlyphs( m_ttf_font, prev, c );
+  }
+#endif
+#endif
+  return 0;
+}
+
 
 Vec2 Font::metrics( const std::string& text ) const
 {
-  Vec2 m;
-  TTF_SizeText( m_ttf_font, text.c_str(), &m.x, &m.y );
-  return m;
+  return metrics( text.data(), text.length() );
+}
+
+Vec2 Font::metrics( const char* text, size_t len ) const
+{
+  // same pen walk as drawLeft so measured and drawn widths agree
+  int x = 0;
+  unsigned char prev = 0;
+  for ( size_t i=0; i<len; i++ ) {
+    unsigned char c = text[i];
+    x += kerning( prev, c ) + glyph( c ).advance;
+    prev = c;
+  }
+  return Vec2( x, m_lineHeight );
 }
 
 
@@ -49,12 +150,30 @@ void Font::drawLeft( Canvas* canvas, Vec2 pt,
 {
   if (text.empty())
       return;
-    
+
+  int x = pt.x;
+  unsigned char prev = 0;
+  for ( size_t i=0; i<text.length(); i++ ) {
+    unsigned char c = text[i];
+    const Glyph& g = glyph( c );
+    x += kerning( prev, c );
+    if ( !g.src.isEmpty() ) {
+      m_atlas->tint( colour );
+      canvas->drawImage( m_atlas, g.src, x + g.minx, pt.y );
+    }
+    x += g.advance;
+    prev = c;
+  }
+}
+
+Canvas* Font::render( const std::string& text, int colour ) const
+{
+  if (text.empty())
+      return NULL;
+
   SDL_Color fg = { static_cast<Uint8>(colour>>16), static_cast<Uint8>(colour>>8), static_cast<Uint8>(colour) };
-  FontCanvas temp( TTF_RenderText_Blended( m_ttf_font,
-					   text.c_str(),
-					   fg ) );
-  canvas->drawImage( &temp, pt.x, pt.y );
+  SDL_Surface* s = TTF_RenderText_Blended( m_ttf_font, text.c_str(), fg );
+  return s ? new FontCanvas( s ) : NULL;
 }
 
 void Font::drawRight( Canvas* canvas, Vec2 pt,
@@ -111,3 +230,44 @@ const Font* Font::blurbFont()
   return f;
 }
 
+
+
+bool TextCache::Key::operator<( const Key& o ) const
+{
+  if ( font != o.font ) return font < o.font;
+  if ( colour != o.colour ) return colour < o.colour;
+  return text < o.text;
+}
+
+TextCache::TextCache( int maxBytes )
+  : m_cache( maxBytes )
+{}
+
+Canvas* TextCache::get( const Font* font, const std::string& text, int colour )
+{
+  if ( text.empty() ) {
+    return NULL;
+  }
+
+  Key key;
+  key.font = font;
+  key.text = text;
+  key.colour = colour;
+  Canvas* canvas = m_cache.find( key );
+  if ( canvas ) {
+    return canvas;
+  }
+
+  canvas = font->render( text, colour );
+  if ( !canvas ) {
+    return NULL;
+  }
+  // the entry just handed out is never the one evicted
+  return m_cache.insert( key, canvas, canvas->width() * canvas->height() * 4 );
+}
+
+TextCache& TextCache::instance()
+{
+  static TextCache cache;
+  return cache;
+}
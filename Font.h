@@ -19,17 +19,29 @@
 
 #include "Common.h"
 #include "Path.h"
+#include "Config.h"
+#include "LruCache.h"
 #include <string>
 #include <SDL_ttf.h>
 
 class Canvas;
+struct FontCanvas;
 
+/**
+ * @brief TrueType font drawn from a glyph atlas
+ *
+ * Each character is rasterised once, in white, into an atlas owned by
+ * the font along with its advance. Drawing a string blits the run of
+ * glyphs tinted to the requested colour.
+ */
 class Font
 {
  public:
   Font( const std::string& file, int ptsize=10 );
+  ~Font();
   int height() const { return m_height; }
   Vec2 metrics( const std::string& text ) const;
+  Vec2 metrics( const char* text, size_t len ) const;
   void drawLeft( Canvas* canvas, Vec2 pt,
 		 const std::string& text, int colour ) const;
   void drawRight( Canvas* canvas, Vec2 pt,
@@ -38,13 +50,62 @@ class Font
 		   const std::string& text, int colour ) const;
   void drawWrap( Canvas* canvas, Rect area,
 		 const std::string& text, int colour ) const;
+  /// @return text rendered to a new canvas, or NULL if it is empty
+  Canvas* render( const std::string& text, int colour ) const;
 
   static const Font* titleFont();
   static const Font* headingFont();
   static const Font* blurbFont();
  private:
+  struct Glyph {
+    bool cached;
+    Rect src;     // in the atlas, empty for blank glyphs
+    int  minx;    // offset of src from the pen position, <= 0
+    int  advance;
+  };
+  const Glyph& glyph( unsigned char c ) const;
+  int kerning( unsigned char prev, unsigned char c ) const;
+
   TTF_Font* m_ttf_font;
   int m_height;
+  int m_lineHeight;
+  mutable Glyph m_glyphs[256];
+  mutable FontCanvas* m_atlas;
+  mutable Vec2 m_atlasPen;
+};
+
+
+/**
+ * @brief Least recently used cache of rendered strings
+ *
+ * For static text such as button captions, which can then be drawn
+ * with a single blit. Memory use is capped at maxBytes of pixels.
+ */
+class TextCache
+{
+ public:
+  TextCache( int maxBytes=TEXT_CACHE_BYTES );
+
+  /// @return rendered text owned by the cache, NULL for empty text
+  Canvas* get( const Font* font, const std::string& text, int colour );
+  void clear() { m_cache.clear(); }
+
+  int hits() const { return m_cache.hits(); }
+  int misses() const { return m_cache.misses(); }
+  int bytes() const { return m_cache.bytes(); }
+  int size() const { return m_cache.size(); }
+
+  /// cache shared by the widgets
+  static TextCache& instance();
+
+ private:
+  struct Key {
+    const Font* font;
+    std::string text;
+    int colour;
+    bool operator<( const Key& o ) const;
+  };
+  LruCache<Key,Canvas> m_cache;
 };
 
 
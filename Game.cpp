@@ -27,6 +27,7 @@
 #include "Script.h"
 #include "Dialogs.h"
 #include "Ui.h"
+#include "Worker.h"
 
 #include <SDL.h>
 #include <SDL_image.h>
@@ -37,6 +38,7 @@
 #include <fstream>
 #include <memory.h>
 #include <errno.h>
+#include <stdint.h>
 #include <sys/stat.h>
 
 using namespace std;
@@ -44,6 +46,52 @@ using namespace std;
 unsigned char levelbuf[64*1024];
 
 
+/// Loads and embodies a level on the ThreadPool while another is played
+class LevelPrefetch : public Task
+{
+public:
+  LevelPrefetch( Levels* levels, int level )
+    : Task( LOW ),
+      m_levels( levels ),
+      m_level( level ),
+      m_ok( false )
+  {}
+  ~LevelPrefetch()
+  {
+    // run() fills m_scene, so it must be over before the scene goes
+    cancel();
+    wait();
+  }
+
+  int level() const { return m_level; }
+  /// @return true if the level is ready to be swapped in, waits if needed
+  bool ok() { wait(); return !cancelled() && m_ok; }
+  Scene& scene() { return m_scene; }
+
+  virtual void run()
+  {
+    try {
+      int size = m_levels->load( m_level, m_buf, sizeof(m_buf) );
+      if ( size && !cancelRequested() && m_scene.load( m_buf, size ) ) {
+	m_scene.prepare();
+	m_ok = true;
+      }
+    } catch ( const std::exception& e ) {
+      // leave it to the synchronous load to report
+    } catch ( const char* e ) {
+    }
+  }
+
+private:
+  Levels       *m_levels;
+  int           m_level;
+  bool          m_ok;
+  Scene         m_scene;
+  unsigned char m_buf[sizeof(levelbuf)];
+};
+
+
+
 #define JOINT_IND_PATH "282,39 280,38 282,38 285,39 300,39 301,60 303,66 302,64 301,63 300,48 297,41 296,42 294,43 293,45 291,46 289,48 287,49 286,52 284,53 283,58 281,62 280,66 282,78 284,82 287,84 290,85 294,88 297,88 299,89 302,90 308,90 311,89 314,89 320,85 321,83 323,83 324,81 327,78 328,75 327,63 326,58 325,55 323,54 321,51 320,49 319,48 316,46 314,44 312,43 314,43"
 
 
@@ -62,6 +110,11 @@ class Game : public GameControl, public Container
   bool              m_isCompleted;
   Path              m_jointCandidates;
   Path              m_jointInd;
+  LevelPrefetch    *m_prefetch;
+  HttpUpload       *m_upload;
+  Widget           *m_uploadDialog;
+  int               m_sendProgress;
+  int               m_seekTarget;   // replay tick being sought, or -1
 public:
   Game( Levels* levels, int width, int height ) 
   : m_createStroke(NULL),
@@ -72,7 +125,12 @@ public:
     m_options( NULL ),
     m_os( Os::get() ),
     m_isCompleted(false),
-    m_jointInd(JOINT_IND_PATH)
+    m_jointInd(JOINT_IND_PATH),
+    m_prefetch(NULL),
+    m_upload(NULL),
+    m_uploadDialog(NULL),
+    m_sendProgress(-1),
+    m_seekTarget(-1)
   {
     setEventMap(Os::get()->getEventMap(GAME_MAP));
     sizeTo(Vec2(width,height));
@@ -86,15 +144,45 @@ public:
     m_levels = levels;
     gotoLevel(0);
     //add( new Button("O",Event::OPTION), Rect(800-32,0,32,32) );
+    if ( SIMULATION_THREAD ) {
+      m_scene.runThreaded( true );
+    }
   }
 
 
+  ~Game()
+  {
+    cancelPrefetch();
+    delete m_upload;
+  }
+
   const char* name() {return "Game";}
 
+  void prefetch( int level )
+  {
+    cancelPrefetch();
+    if ( level >= 0 && level < m_levels->numLevels() ) {
+      m_prefetch = new LevelPrefetch( m_levels, level );
+      ThreadPool::get().submit( m_prefetch );
+    }
+  }
+
+  /// must be done before m_levels is modified
+  void cancelPrefetch()
+  {
+    if ( m_prefetch ) {
+      m_prefetch->cancel();
+      m_prefetch->wait();
+      delete m_prefetch;
+      m_prefetch = NULL;
+    }
+  }
+
   void gotoLevel( int level, bool replay=false )
   {
     bool ok = false;
     m_replaying = replay;
+    m_seekTarget = -1;
 
     if ( replay ) {
       // reset scene, delete user strokes, but retain log
@@ -102,11 +190,22 @@ public:
       m_scene.start( true );
       ok = true;
     } else if ( level >= 0 && level < m_levels->numLevels() ) {
-      int size = m_levels->load( level, levelbuf, sizeof(levelbuf) );
-      if ( size && m_scene.load( levelbuf, size ) ) {
+      if ( m_prefetch && m_prefetch->level() == level && m_prefetch->ok() ) {
+	m_scene.swap( m_prefetch->scene() );
 	m_scene.start( m_scene.getLog()->size() > 0 );
 	ok = true;
       }
+      cancelPrefetch();
+      if ( !ok ) {
+	int size = m_levels->load( level, levelbuf, sizeof(levelbuf) );
+	if ( size && m_scene.load( levelbuf, size ) ) {
+	  m_scene.start( m_scene.getLog()->size() > 0 );
+	  ok = true;
+	}
+      }
+      if ( ok ) {
+	prefetch( level+1 );
+      }
     }
 
     if (ok) {
@@ -134,6 +233,8 @@ public:
       file = "L99_saved.nph";
     }
     if ( m_scene.save( p ) ) {
+      cancelPrefetch();
+      cancelLevelThumbnails();
       m_levels->addPath( p.c_str() );
       int l = m_levels->findLevel( p.c_str() );
       if ( l >= 0 ) {
@@ -149,23 +250,57 @@ public:
 
   bool send()
   {
-    if ( save( SEND_TEMP_FILE ) ) {
-      Http h;
-      if ( h.post( (Config::planetRoot()+"/upload").c_str(),
-		   "data", SEND_TEMP_FILE, "type=1" ) ) {
-	std::string id = h.getHeader("NP-Upload-Id");
-	if ( id.length() > 0 ) {
-	  if ( !m_os->openBrowser((Config::planetRoot()+"/editlevel?id="+id).c_str()) ) {
-	    showMessage("Unable to launch browser");
-	  }
-	} else {
-	  showMessage("UploadFailed: unknown error");
+    if ( !m_upload && save( SEND_TEMP_FILE ) ) {
+      m_upload = new HttpUpload( Config::planetRoot()+"/upload",
+				 "data", SEND_TEMP_FILE, "type=1" );
+      m_upload->http().encoding( Http::MULTIPART );
+      m_sendProgress = 0;
+      m_uploadDialog = createUploadDialog(this);
+      add( m_uploadDialog );
+      m_upload->start();
+      return true;
+    }
+    return false;
+  }
+
+  void cancelSend()
+  {
+    // the upload dialog closes itself
+    m_uploadDialog = NULL;
+    if ( m_upload && m_upload->cancel() ) {
+      // withdrawn before it ran, there will be no HTTP_DONE
+      finishSend();
+    }
+  }
+
+  int sendProgress()
+  {
+    return m_upload ? m_sendProgress : -1;
+  }
+
+  void finishSend()
+  {
+    bool ok = m_upload->ok();
+    Http& h = m_upload->http();
+    remove( m_uploadDialog );
+    m_uploadDialog = NULL;
+    if ( m_upload->cancelRequested() ) {
+      showMessage("Upload cancelled");
+    } else if ( ok ) {
+      std::string id = h.getHeader("NP-Upload-Id");
+      if ( id.length() > 0 ) {
+	if ( !m_os->openBrowser((Config::planetRoot()+"/editlevel?id="+id).c_str()) ) {
+	  showMessage("Unable to launch browser");
 	}
       } else {
-	showMessage(std::string("UploadFailed: ")+h.errorMessage());
+	showMessage("UploadFailed: unknown error");
       }
+    } else {
+      showMessage(std::string("UploadFailed: ")+h.errorMessage());
     }
-    return false;
+    delete m_upload;
+    m_upload = NULL;
+    m_sendProgress = -1;
   }
 
   void saveDemo()
@@ -178,6 +313,11 @@ public:
     } 
   }
 
+  void speed( int ticksPerTick )
+  {
+    m_scene.setSpeed( ticksPerTick );
+  }
+
   void clickMode(int cm)
   {
     if (cm != m_clickMode) {
@@ -272,6 +412,7 @@ public:
   virtual Rect dirtyArea() 
   {
     //todo include dirt  for old joint candidates
+    Scene::Lock lock( m_scene );
     m_jointCandidates.clear();
     if ( m_refresh  ) {
       if ( m_createStroke ) {
@@ -301,12 +442,27 @@ public:
     if (w==m_completedDialog) {
       m_completedDialog = NULL;
     }
+    if (w==m_uploadDialog) {
+      m_uploadDialog = NULL;
+    }
     Container::remove(w);
   }
 
   virtual void onTick( int tick ) 
   {
-    m_scene.step( isPaused() );
+    Scene::Lock lock( m_scene );
+    if ( m_seekTarget >= 0 ) {
+      // spread the seek over ticks rather than stalling one frame
+      if ( m_scene.seek( m_seekTarget, REPLAY_SEEK_STEPS )
+	   || !m_scene.replay()->isRunning() ) {
+	m_seekTarget = -1;
+      }
+      m_refresh = true;
+    } else if ( m_scene.isThreaded() ) {
+      m_scene.setPaused( isPaused() );
+    } else if ( !m_scene.isQuiescent( isPaused() ) ) {
+      m_scene.step( isPaused() );
+    }
 
     if ( m_isCompleted && m_completedDialog && m_edit ) {
       remove( m_completedDialog );
@@ -334,6 +490,8 @@ public:
 	if ( strstr(f,".npz") ) {
 	  //m_levels->empty();
 	}
+	cancelPrefetch();
+	cancelLevelThumbnails();
 	m_levels->addPath( f );
 	int l = m_levels->findLevel( f );
 	if ( l >= 0 ) {
@@ -345,11 +503,22 @@ public:
     Container::onTick(tick);
   }
 
+  virtual bool isIdle()
+  {
+    Scene::Lock lock( m_scene );
+    return m_scene.isQuiescent( isPaused() )
+      && m_jointCandidates.size() == 0
+      && !m_createStroke && !m_moveStroke
+      && Container::isIdle();
+  }
+
   virtual void draw( Canvas& screen, const Rect& area )
   {
     static int drawCount = 0 ;
     m_refresh = false;
-    m_scene.draw( screen, area );
+    // fading the background and strokes as they are drawn is cheaper
+    // than fading the whole area afterwards
+    m_scene.draw( screen, area, m_fade );
     if ( m_jointCandidates.size() ) {
       float32 rot = (float32)(drawCount&127) / 128.0f;
       for ( unsigned i=0; i<m_jointCandidates.size(); i++ ) {
@@ -357,13 +526,10 @@ public:
 	joint.translate( -joint.bbox().centroid() );
 	joint.rotate( b2Rot(rot*2.0*3.141) );
 	joint.translate( m_jointCandidates[i] + joint.bbox().centroid() );
-	screen.drawPath( joint, 0x606060 );
+	screen.drawPath( joint, m_fade ? screen.fadeColour(0x606060) : 0x606060 );
       }
       drawCount++;
     }
-    if ( m_fade ) {
-      screen.fade( area );
-    }
     Container::draw(screen,area);
   }
 
@@ -371,7 +537,14 @@ public:
   {
     Event opt1Event(Event::OPTION,1);
     Event opt2Event(Event::OPTION,2);
-    if (ev.type==SDL_MOUSEBUTTONDOWN) {
+    if (ev.type==SDL_USEREVENT && m_upload && ev.user.data1==m_upload) {
+      if (ev.user.code==HTTP_PROGRESS) {
+	m_sendProgress = (int)(intptr_t)ev.user.data2;
+      } else if (ev.user.code==HTTP_DONE) {
+	finishSend();
+      }
+      return true;
+    } else if (ev.type==SDL_MOUSEBUTTONDOWN) {
       if (ev.button.x < 10
 	  && dispatchEvent(opt1Event)) {
 	return true;
@@ -385,6 +558,7 @@ public:
 
   virtual bool onEvent( Event& ev )
   {
+    Scene::Lock lock( m_scene );
     bool used = true;
     switch (ev.code) {
     case Event::MENU:
@@ -479,6 +653,21 @@ public:
     case Event::REPLAY:
       gotoLevel( ev.x, true );
       break;
+    case Event::REWIND:
+    case Event::FORWARD:
+      if ( m_scene.replay()->isRunning() ) {
+	// seeking rebuilds the strokes, forget any in-flight edits
+	m_createStroke = NULL;
+	m_moveStroke = NULL;
+	int t = m_seekTarget >= 0 ? m_seekTarget : m_scene.replay()->ticks();
+	if ( ev.code == Event::REWIND ) {
+	  t -= REPLAY_SEEK_TICKS;
+	} else {
+	  t += REPLAY_SEEK_TICKS;
+	}
+	m_seekTarget = t < 0 ? 0 : t;
+      }
+      break;
     case Event::PLAY:
       gotoLevel( ev.x );
       break;
@@ -58,9 +58,17 @@ struct GameControl
   virtual ~GameControl() {}
   virtual bool save( const char *file=NULL ) =0;
   virtual bool send() =0;
+  /// abandon an upload started by send()
+  virtual void cancelSend() {}
+  /// @return percentage of the current upload sent, or -1 if none
+  virtual int sendProgress() { return -1; }
   virtual bool load( const char* file ) { return false; };
   virtual void gotoLevel( int l, bool replay=false ) =0;
   virtual void clickMode(int cm) =0;
+  /// simulation ticks per paced tick, 0 = as fast as possible; only a
+  /// threaded simulation needs telling, otherwise onTick() is just called
+  /// that many times
+  virtual void speed( int ticksPerTick ) {}
   Levels& levels() { return *m_levels; }
   const GameStats& stats() { return m_stats; }
   bool  m_quit;
@@ -20,9 +20,17 @@
 #include <stdexcept>
 
 #include "Http.h"
+#include "Event.h"
 #include "happyhttp.h"
+#include <SDL.h>
+#include <stdint.h>
 using namespace happyhttp;
 
+#define POST_CHUNK 4096
+#define HTTP_PIPELINE_DEPTH 8u
+#define HTTP_MAX_FAILURES 3
+#define HTTP_IDLE_TIMEOUT_MS 10000
+
 
 
 static void http_begin_cb( const Response* r, void* userdata )
@@ -114,62 +122,163 @@ bool Http::get( const char* uri,
 }
 
 
+static const char hex[16+1] = "0123456789ABCDEF";
+static const char* BOUNDARY = "NumptyPhysics-7d3a91c6e8b2";
+
+/// percent encode n bytes into out, which must hold 3*n
+/// @return encoded length
+static int urlEncode( const unsigned char* in, int n, char* out )
+{
+  char *o = out;
+  for ( int i=0; i<n; i++ ) {
+    unsigned char c = in[i];
+    if ( (c>='a' && c<='z') || (c>='A' && c<='Z') || (c>='0' && c<='9') ) {
+      *o++ = c;
+    } else {
+      *o++ = '%';
+      *o++ = hex[c>>4];
+      *o++ = hex[c&0xf];
+    }
+  }
+  return o - out;
+}
+
+static int urlEncodedLength( const unsigned char* in, int n )
+{
+  int len = 0;
+  for ( int i=0; i<n; i++ ) {
+    unsigned char c = in[i];
+    len += ( (c>='a' && c<='z') || (c>='A' && c<='Z') || (c>='0' && c<='9') ) ? 1 : 3;
+  }
+  return len;
+}
+
+static std::string formPart( const std::string& name )
+{
+  return std::string("--") + BOUNDARY + "\r\n"
+    + "Content-Disposition: form-data; name=\"" + name + "\"";
+}
+
+/// split "a=1&b=2" into one form-data part per argument
+static std::string multipartArgs( const char* otherargs )
+{
+  std::string parts;
+  std::string args = otherargs ? otherargs : "";
+  std::size_t start = 0;
+  while ( start < args.length() ) {
+    std::size_t end = args.find( '&', start );
+    if ( end == std::string::npos ) end = args.length();
+    std::string arg = args.substr( start, end-start );
+    std::size_t eq = arg.find( '=' );
+    if ( eq != std::string::npos ) {
+      parts += formPart( arg.substr(0,eq) ) + "\r\n\r\n"
+	+ arg.substr(eq+1) + "\r\n";
+    }
+    start = end + 1;
+  }
+  return parts;
+}
+
+
 bool Http::post( const char* uri, const char*putname, const char* putfile,
-		 const char* otherargs )
+		 const char* otherargs, HttpProgress progress, void* user )
 {
   char host[256];
   char path[256];
-  char data[64*1024];
+  unsigned char in[POST_CHUNK];
+  char out[3*POST_CHUNK];
   int port;
-  static char hex[16+1] = "0123456789ABCDEF";
 
-  if ( otherargs ) {
-    sprintf(data,"%s&%s=",otherargs,putname);
-  } else {
-    sprintf(data,"%s=",putname);
+  FILE *file = fopen( putfile, "rb" );
+  if ( !file ) {
+    m_err = "cannot read ";
+    m_err += putfile;
+    return false;
   }
-  char *buf = &data[strlen(data)];
-  
-  m_file = fopen( putfile, "rt" );
-  while ( !feof(m_file) ) {
-    unsigned char c = fgetc( m_file );
-    switch ( c ) {
-    case 'a'...'z':
-    case 'A'...'Z':
-    case '0'...'9':
-      *buf++ = c;
-      break;
-    default:
-      *buf++ = '%';
-      *buf++ = hex[c>>4];
-      *buf++ = hex[c&0xf];
-      break;
+
+  // the body is streamed so work out its length up front
+  std::string head, tail, type;
+  int fileLength = 0;
+  if ( m_encoding == MULTIPART ) {
+    const char* name = strrchr( putfile, '/' );
+    name = name ? name+1 : putfile;
+    head = multipartArgs( otherargs ) + formPart( putname )
+      + "; filename=\"" + name + "\"\r\n"
+      + "Content-Type: application/octet-stream\r\n\r\n";
+    tail = std::string("\r\n--") + BOUNDARY + "--\r\n";
+    type = std::string("multipart/form-data; boundary=") + BOUNDARY;
+    fseek( file, 0, SEEK_END );
+    fileLength = ftell( file );
+    fseek( file, 0, SEEK_SET );
+  } else {
+    head = otherargs ? std::string(otherargs) + "&" : std::string();
+    head += std::string(putname) + "=";
+    type = "application/x-www-form-urlencoded";
+    for ( int n; (n = fread( in, 1, sizeof(in), file )) > 0; ) {
+      fileLength += urlEncodedLength( in, n );
     }
-    //m_size = fread(data,1,sizeof(data),m_file);
+    rewind( file );
   }
-  fclose ( m_file );
-  m_size = buf - &data[0];
+  int total = head.length() + fileLength + tail.length();
 
   const char* headers[] = {
     "Connection", "close",
-    "Content-type", "application/x-www-form-urlencoded",
+    "Content-type", type.c_str(),
     "Accept", "text/plain",
     0
   };
-  
+
+  m_size = -1;
+  bool cancelled = false;
   if ( parseUri( uri, &host[0], &port, &path[0] ) ) {
     try {
       Connection con( host, port );
       con.setcallbacks( http_begin_cb, http_post_cb, http_complete_cb, this );
-      con.request("POST",path,headers,(unsigned char*)data,m_size);
-      while ( con.outstanding() ) {
+      con.putrequest( "POST", path );
+      con.putheader( "Content-Length", total );
+      for ( int h=0; headers[h]; h+=2 ) {
+	con.putheader( headers[h], headers[h+1] );
+      }
+      con.endheaders();
+
+      // one chunk of the file at a time so the caller can follow along
+      // and bail out, and memory use does not grow with the level
+      con.send( (const unsigned char*)head.data(), head.length() );
+      int sent = head.length();
+      for ( int n; !cancelled && (n = fread( in, 1, sizeof(in), file )) > 0; ) {
+	if ( m_encoding == MULTIPART ) {
+	  con.send( in, n );
+	} else {
+	  n = urlEncode( in, n, out );
+	  con.send( (const unsigned char*)out, n );
+	}
+	sent += n;
+	cancelled = progress && !progress( user, sent, total );
+      }
+      if ( !cancelled && tail.length() ) {
+	con.send( (const unsigned char*)tail.data(), tail.length() );
+	cancelled = progress && !progress( user, total, total );
+      }
+
+      while ( !cancelled && con.outstanding() ) {
 	con.pump();
+	if ( progress ) {
+	  cancelled = !progress( user, total, total );
+	  SDL_Delay( 1 );
+	}
       }
     } catch ( Wobbly w ) {
-	throw std::runtime_error(w.what());
+      fclose( file );
+      throw std::runtime_error(w.what());
     }
   }
-  return true;
+  fclose( file );
+
+  if ( cancelled ) {
+    m_err = "cancelled";
+    return false;
+  }
+  return m_size >= 0;
 }
 
 
@@ -184,3 +293,265 @@ std::string Http::getHeader( const char* name )
   return m_npid;
 }
 
+
+
+HttpClient::HttpClient( const std::string& root )
+  : m_port( 80 ),
+    m_con( NULL ),
+    m_closing( false ),
+    m_connections( 0 ),
+    m_completed( 0 ),
+    m_lastActivity( 0 )
+{
+  char host[256];
+  char path[256];
+  parseUri( (root+"/").c_str(), &host[0], &m_port, &path[0] );
+  m_host = host;
+  m_base = path;
+  m_base.erase( m_base.length()-1 );
+}
+
+HttpClient::~HttpClient()
+{
+  disconnect();
+}
+
+void HttpClient::get( const std::string& path, const std::string& file )
+{
+  Request r;
+  r.path = m_base + path;
+  r.file = file;
+  r.out = NULL;
+  r.ok = false;
+  m_pending.push_back( r );
+}
+
+void HttpClient::onBegin( const Response* r, void* client )
+{
+  HttpClient* self = (HttpClient*)client;
+  Request& req = self->m_inflight.front();
+  self->m_lastActivity = SDL_GetTicks();
+  if ( r->getstatus() == OK ) {
+    // written aside so a broken transfer never looks like a level
+    req.out = fopen( (req.file+".part").c_str(), "wb" );
+  } else {
+    self->m_err = req.path + ": " + r->getreason();
+  }
+}
+
+void HttpClient::onData( const Response* r, void* client,
+			 const unsigned char* data, int n )
+{
+  HttpClient* self = (HttpClient*)client;
+  Request& req = self->m_inflight.front();
+  self->m_lastActivity = SDL_GetTicks();
+  if ( req.out ) {
+    fwrite( data, 1, n, req.out );
+  }
+}
+
+void HttpClient::onComplete( const Response* r, void* client )
+{
+  HttpClient* self = (HttpClient*)client;
+  Request req = self->m_inflight.front();
+  self->m_inflight.pop_front();
+  if ( req.out ) {
+    fclose( req.out );
+    req.out = NULL;
+    std::string part = req.file + ".part";
+    req.ok = rename( part.c_str(), req.file.c_str() ) == 0;
+    if ( !req.ok ) {
+      remove( part.c_str() );
+    }
+  }
+  self->m_done.push_back( req );
+  self->m_completed++;
+  self->m_lastActivity = SDL_GetTicks();
+  if ( r->willclose() ) {
+    // anything else pipelined on this connection will be dropped
+    self->m_closing = true;
+  }
+}
+
+void HttpClient::connect()
+{
+  m_closing = false;
+  m_completed = 0;
+  m_connections++;
+  m_lastActivity = SDL_GetTicks();
+  m_con = new Connection( m_host.c_str(), m_port );
+  m_con->setcallbacks( onBegin, onData, onComplete, this );
+  m_con->connect();
+}
+
+void HttpClient::disconnect()
+{
+  delete m_con;
+  m_con = NULL;
+  // resend whatever was still waiting for an answer
+  while ( m_inflight.size() ) {
+    Request& req = m_inflight.back();
+    if ( req.out ) {
+      fclose( req.out );
+      remove( (req.file+".part").c_str() );
+      req.out = NULL;
+    }
+    m_pending.push_front( req );
+    m_inflight.pop_back();
+  }
+}
+
+int HttpClient::fetch( HttpProgress progress, void* user )
+{
+  int total = m_pending.size();
+  int failures = 0;
+  while ( m_pending.size() || m_inflight.size() ) {
+    int before = m_done.size();
+    try {
+      if ( !m_con ) {
+	connect();
+      }
+      while ( m_pending.size() && m_inflight.size() < HTTP_PIPELINE_DEPTH ) {
+	m_inflight.push_back( m_pending.front() );
+	m_pending.pop_front();
+	m_con->putrequest( "GET", m_inflight.back().path.c_str() );
+	m_con->putheader( "Accept", "text/plain" );
+	m_con->endheaders();
+      }
+      m_con->pump();
+      if ( m_inflight.size() && !m_con->outstanding() ) {
+	// server hung up on the rest of the pipeline
+	throw Wobbly( "Connection closed unexpectedly" );
+      }
+      if ( m_inflight.size()
+	   && SDL_GetTicks() - m_lastActivity > HTTP_IDLE_TIMEOUT_MS ) {
+	// connected but silent, try a fresh connection
+	throw Wobbly( "Timed out waiting for server" );
+      }
+    } catch ( Wobbly w ) {
+      m_err = w.what();
+      m_closing = true;
+      // keep going while connections get somewhere, give up on a server
+      // that will not answer at all
+      if ( m_completed == 0 && ++failures >= HTTP_MAX_FAILURES ) {
+	disconnect();
+	break;
+      }
+    }
+    if ( m_completed > 0 ) {
+      failures = 0;
+    }
+    if ( m_closing ) {
+      disconnect();
+    }
+
+    if ( (int)m_done.size() == before ) {
+      SDL_Delay( 1 );
+    } else if ( progress && !progress( user, m_done.size(), total ) ) {
+      m_err = "cancelled";
+      disconnect();
+      break;
+    }
+  }
+
+  int fetched = 0;
+  for ( unsigned i=0; i<m_done.size(); i++ ) {
+    if ( m_done[i].ok ) fetched++;
+  }
+  m_done.clear();
+  m_pending.clear();
+  return fetched;
+}
+
+int HttpClient::syncPack( const std::string& pack, const std::string& dir,
+			  HttpProgress progress, void* user )
+{
+  std::string index = dir + "/" + pack + ".txt";
+  get( "/packs/" + pack + ".txt", index );
+  if ( fetch() == 0 ) {
+    return 0;
+  }
+
+  FILE *f = fopen( index.c_str(), "rt" );
+  char line[256];
+  while ( f && fgets( line, sizeof(line), f ) ) {
+    std::string name( line );
+    name.erase( name.find_last_not_of( " \t\r\n" ) + 1 );
+    // plain file names only, nothing that could climb out of dir
+    if ( name.empty() || name.find( '/' ) != std::string::npos
+	 || name.find( '\\' ) != std::string::npos || name[0] == '.' ) {
+      continue;
+    }
+    std::string file = dir + "/" + name;
+    FILE *existing = fopen( file.c_str(), "rb" );
+    if ( existing ) {
+      fclose( existing );
+    } else {
+      get( "/packs/" + pack + "/" + name, file );
+    }
+  }
+  if ( f ) {
+    fclose( f );
+  }
+  remove( index.c_str() );
+  return fetch( progress, user );
+}
+
+
+HttpUpload::HttpUpload( const std::string& uri, const std::string& putname,
+			const std::string& putfile, const std::string& otherargs )
+  : Task( HIGH ),
+    m_uri( uri ),
+    m_putname( putname ),
+    m_putfile( putfile ),
+    m_otherargs( otherargs ),
+    m_ok( false ),
+    m_percent( -1 )
+{
+}
+
+HttpUpload::~HttpUpload()
+{
+  cancel();
+  wait();
+}
+
+void HttpUpload::start()
+{
+  ThreadPool::get().submit( this );
+}
+
+bool HttpUpload::onProgress( void* upload, int sent, int total )
+{
+  HttpUpload *self = (HttpUpload*)upload;
+  int percent = total > 0 ? sent * 100 / total : 100;
+  if ( percent != self->m_percent ) {
+    self->m_percent = percent;
+    SDL_Event event;
+    event.type = SDL_USEREVENT;
+    event.user.code = HTTP_PROGRESS;
+    event.user.data1 = self;
+    event.user.data2 = (void*)(intptr_t)percent;
+    SDL_PushEvent( &event );
+  }
+  return !self->cancelRequested();
+}
+
+void HttpUpload::run()
+{
+  try {
+    m_ok = m_http.post( m_uri.c_str(), m_putname.c_str(), m_putfile.c_str(),
+			m_otherargs.length() ? m_otherargs.c_str() : NULL,
+			onProgress, this );
+  } catch ( const std::exception& e ) {
+    m_http.m_err = e.what();
+    m_ok = false;
+  }
+
+  SDL_Event event;
+  event.type = SDL_USEREVENT;
+  event.user.code = HTTP_DONE;
+  event.user.data1 = this;
+  event.user.data2 = 0;
+  SDL_PushEvent( &event );
+}
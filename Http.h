@@ -17,14 +17,30 @@
 #include <stdio.h>
 #include <string.h>
 #include <string>
+#include <deque>
+#include <vector>
+#include "Worker.h"
+
+namespace happyhttp { class Connection; class Response; }
+
+/// @return false to abandon the transfer
+typedef bool (*HttpProgress)( void* user, int sent, int total );
 
 class Http 
 {
 public:
+  /// how post() sends the file: percent encoded, or raw bytes in a
+  /// multipart/form-data body which avoids the up to 3x expansion
+  enum Encoding { URL_ENCODED, MULTIPART };
+
+  Http() : m_file(NULL), m_size(-1), m_encoding(URL_ENCODED) {}
+  void encoding( Encoding e ) { m_encoding = e; }
+
   // start
   bool get( const char* uri, const char* file );
   bool post( const char* uri, const char*putname, const char* putfile,
-	     const char* otherargs=NULL );
+	     const char* otherargs=NULL,
+	     HttpProgress progress=NULL, void* user=NULL );
 
   // response
   std::string errorMessage();
@@ -35,7 +51,102 @@ public:
   int   m_size;
   std::string m_err;
   std::string m_npid;
+  Encoding m_encoding;
+
+};
+
+
+/**
+ * @brief Batch of GETs against one server over a kept-alive connection
+ *
+ * Requests are pipelined, several in flight at once, and the connection
+ * is reopened if the server closes it part way through the batch.
+ */
+class HttpClient
+{
+public:
+  /// @param root "http://host[:port]" that request paths are relative to
+  HttpClient( const std::string& root );
+  ~HttpClient();
+
+  /// queue a GET of root+path, saved to file if it succeeds
+  void get( const std::string& path, const std::string& file );
+  /// send the queued GETs and wait for all of them
+  /// @return number of files saved
+  int fetch( HttpProgress progress=NULL, void* user=NULL );
+
+  /**
+   * @brief Download a level pack into dir
+   *
+   * Fetches root/packs/<pack>.txt, a list of level file names one per
+   * line, then every listed level not already in dir from
+   * root/packs/<pack>/<name>.
+   * @return number of levels downloaded
+   */
+  int syncPack( const std::string& pack, const std::string& dir,
+		HttpProgress progress=NULL, void* user=NULL );
+
+  std::string errorMessage() const { return m_err; }
+  /// @return number of connections opened so far
+  int connections() const { return m_connections; }
+
+private:
+  struct Request {
+    std::string path;
+    std::string file;
+    FILE       *out;
+    bool        ok;
+  };
+
+  static void onBegin( const happyhttp::Response* r, void* client );
+  static void onData( const happyhttp::Response* r, void* client,
+		      const unsigned char* data, int n );
+  static void onComplete( const happyhttp::Response* r, void* client );
+  void connect();
+  void disconnect();
+
+  std::string m_host;
+  int         m_port;
+  std::string m_base;
+  happyhttp::Connection *m_con;
+  bool        m_closing;
+  int         m_connections;
+  int         m_completed;
+  Uint32      m_lastActivity; // SDL_GetTicks of the last byte or connect
+  std::deque<Request> m_pending;
+  std::deque<Request> m_inflight;
+  std::vector<Request> m_done;
+  std::string m_err;
+};
+
+
+/**
+ * @brief Http::post run on the ThreadPool
+ *
+ * Posts HTTP_PROGRESS events as the body goes out and a final HTTP_DONE
+ * once the server has answered, failed or the upload was cancelled.
+ */
+class HttpUpload : public Task
+{
+public:
+  HttpUpload( const std::string& uri, const std::string& putname,
+	      const std::string& putfile, const std::string& otherargs="" );
+  ~HttpUpload();
+  void start();
+  /// wait for and @return whether the server accepted the upload
+  bool ok() { wait(); return m_ok; }
+  Http& http() { return m_http; }
+
+protected:
+  virtual void run();
+
+private:
+  static bool onProgress( void* upload, int sent, int total );
 
+  std::string m_uri, m_putname, m_putfile, m_otherargs;
+  Http        m_http;
+  bool        m_ok;
+  int         m_percent;
 };
 
 
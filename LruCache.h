@@ -0,0 +1,140 @@
+/*
+ * This file is part of NumptyPhysics
+ * Copyright (C) 2008 Tim Edmonds
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ */
+
+#ifndef LRUCACHE_H
+#define LRUCACHE_H
+
+#include <list>
+#include <map>
+#include <cstddef>
+
+/**
+ * @brief Least recently used map of owned values, capped in bytes
+ *
+ * The cache deletes its values when they are evicted, erased or
+ * cleared. Each entry is charged whatever size it was added with.
+ */
+template< typename K, typename V >
+class LruCache
+{
+ public:
+  LruCache( int maxBytes )
+    : m_maxBytes( maxBytes ),
+      m_bytes( 0 ),
+      m_hits( 0 ),
+      m_misses( 0 )
+  {}
+  ~LruCache() { clear(); }
+
+  /// @return the value for key, now the most recently used, or NULL
+  V* find( const K& key )
+  {
+    typename Index::iterator found = m_index.find( key );
+    if ( found == m_index.end() ) {
+      m_misses++;
+      return NULL;
+    }
+    m_hits++;
+    m_entries.splice( m_entries.begin(), m_entries, found->second );
+    return found->second->value;
+  }
+
+  /// take ownership of value as the entry for key, which must be new,
+  /// then evict down to maxBytes sparing the new entry
+  /// @return value
+  V* insert( const K& key, V* value, int bytes )
+  {
+    Entry e;
+    e.key = key;
+    e.value = value;
+    e.bytes = bytes;
+    m_entries.push_front( e );
+    m_index[key] = m_entries.begin();
+    m_bytes += bytes;
+    evict( 1 );
+    return value;
+  }
+
+  bool contains( const K& key ) const
+  {
+    return m_index.find( key ) != m_index.end();
+  }
+
+  /// drop every entry with a key from first to last inclusive
+  void erase( const K& first, const K& last )
+  {
+    typename Index::iterator i = m_index.lower_bound( first );
+    while ( i != m_index.end() && !(last < i->first) ) {
+      m_bytes -= i->second->bytes;
+      delete i->second->value;
+      m_entries.erase( i->second );
+      m_index.erase( i++ );
+    }
+  }
+
+  void clear()
+  {
+    for ( typename EntryList::iterator i=m_entries.begin();
+	  i!=m_entries.end(); ++i ) {
+      delete i->value;
+    }
+    m_entries.clear();
+    m_index.clear();
+    m_bytes = 0;
+  }
+
+  /// change the cap, evicting at once if now over it
+  void maxBytes( int bytes )
+  {
+    m_maxBytes = bytes;
+    evict( 0 );
+  }
+  int maxBytes() const { return m_maxBytes; }
+  int hits() const { return m_hits; }
+  int misses() const { return m_misses; }
+  int bytes() const { return m_bytes; }
+  int size() const { return (int)m_entries.size(); }
+
+ private:
+  struct Entry {
+    K key;
+    V* value;
+    int bytes;
+  };
+  typedef std::list<Entry> EntryList;
+  typedef std::map<K, typename EntryList::iterator> Index;
+
+  void evict( std::size_t keep )
+  {
+    while ( m_bytes > m_maxBytes && m_entries.size() > keep ) {
+      Entry& old = m_entries.back();
+      m_bytes -= old.bytes;
+      m_index.erase( old.key );
+      delete old.value;
+      m_entries.pop_back();
+    }
+  }
+
+  EntryList m_entries;  // most recently used first
+  Index     m_index;
+  int m_maxBytes;
+  int m_bytes;
+  int m_hits;
+  int m_misses;
+};
+
+
+#endif //LRUCACHE_H
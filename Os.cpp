@@ -43,6 +43,8 @@ static const BasicEventMap::KeyPair game_keymap[] = {
   { SDLK_p,        Event::PREVIOUS },
   { SDLK_LEFT,     Event::PREVIOUS },
   { SDLK_v,        Event::REPLAY},
+  { SDLK_LEFTBRACKET,  Event::REWIND },
+  { SDLK_RIGHTBRACKET, Event::FORWARD },
   {}
 };
 
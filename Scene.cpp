@@ -17,12 +17,15 @@
 #include "Config.h"
 #include "Scene.h"
 #include "Accelerometer.h"
+#include <SDL_thread.h>
 
 #include <sstream>
 #include <fstream>
 #include <stdexcept>
 #include <algorithm>
 #include <vector>
+#include <cstring>
+#include <cmath>
 
 
 using namespace std;
@@ -74,6 +77,8 @@ void configureScreenTransform( int w, int h )
       worldToScreen.set( scaleh, rot, tr );
     }
   }
+  // sprites were drawn at the old scale
+  SpriteCache::instance().clear();
 }
 
 
@@ -135,6 +140,8 @@ public:
     : m_rawPath(path)
   {
     m_body = 0;
+    m_spriteSteps = 0;
+    m_spriteMissAngle = -1;
     m_colour = brushColours[DEFAULT_BRUSH];
     m_attributes = 0;
     m_origin = m_rawPath.point(0);
@@ -146,6 +153,8 @@ public:
   {
     int col = 0;
     m_body = 0;
+    m_spriteSteps = 0;
+    m_spriteMissAngle = -1;
     m_colour = brushColours[DEFAULT_BRUSH];
     m_attributes = 0;
     m_origin = Vec2(400,240);
@@ -180,6 +189,19 @@ public:
     setAttribute( ATTRIB_DUMMY );
   }
 
+  Stroke( const StrokeState& state )
+    : m_rawPath(state.path)
+  {
+    m_body = 0;
+    m_spriteSteps = 0;
+    m_spriteMissAngle = -1;
+    m_colour = state.colour;
+    m_attributes = state.attributes;
+    m_origin = m_rawPath.point(0);
+    m_rawPath.translate( -m_origin );
+    reset();
+  }
+
   void reset( b2World* world=NULL )
   {
     if (m_body && world) {
@@ -193,6 +215,12 @@ public:
     m_shapePath = m_rawPath;
     m_hide = 0;
     m_drawn = false;
+    forgetSprites();
+  }
+
+  ~Stroke()
+  {
+    forgetSprites();
   }
 
   std::string asString()
@@ -241,6 +269,9 @@ public:
 
   void createBodies( b2World& world )
   {
+    if ( m_body ) {
+      return; // already embodied, eg. by Scene::prepare()
+    }
     process();
     if ( hasAttribute( ATTRIB_DECOR ) ){
       return; //decorators have no physical embodiment
@@ -307,13 +338,67 @@ public:
     }
   }
 
-  void draw( Canvas& canvas, bool drawJoints=false )
+  void join( b2World* world, Stroke* other, const b2Vec2& anchor )
+  {
+    JointDef j( m_body, other->m_body, anchor );
+    world->CreateJoint( &j );
+  }
+
+  void saveState( StrokeState& state )
+  {
+    state.path = m_rawPath;
+    state.path.translate( m_origin );
+    state.colour = m_colour;
+    state.attributes = m_attributes;
+    state.jointed[0] = m_jointed[0];
+    state.jointed[1] = m_jointed[1];
+    state.hide = m_hide;
+    state.screenPath.clear();
+    if ( m_hide ) {
+      state.screenPath = m_screenPath;
+    }
+    state.hasBody = (m_body != NULL);
+    if ( m_body ) {
+      state.position = m_body->GetPosition();
+      state.angle = m_body->GetAngle();
+      state.linearVelocity = m_body->GetLinearVelocity();
+      state.angularVelocity = m_body->GetAngularVelocity();
+      state.awake = m_body->IsAwake();
+    }
+  }
+
+  void restoreState( const StrokeState& state )
+  {
+    m_jointed[0] = state.jointed[0];
+    m_jointed[1] = state.jointed[1];
+    if ( m_body ) {
+      m_body->SetTransform( state.position, state.angle );
+      m_body->SetAwake( state.awake );
+      if ( state.awake ) {
+	m_body->SetLinearVelocity( state.linearVelocity );
+	m_body->SetAngularVelocity( state.angularVelocity );
+      }
+    }
+    m_hide = state.hide;
+    if ( m_hide ) {
+      m_screenPath = state.screenPath;
+      m_screenBbox = m_screenPath.bbox();
+    }
+    m_drawn = false;
+  }
+
+  void draw( Canvas& canvas, bool drawJoints=false, bool faded=false )
   {
     if ( m_hide < HIDE_STEPS ) {
       int colour = canvas.makeColour(m_colour);
+      if ( faded ) {
+	colour = canvas.fadeColour(colour);
+      }
       bool thick = (canvas.width() > 400);
       transform();
-      canvas.drawPath( m_screenPath, colour, thick );
+      if ( !drawSprite( canvas, thick, faded ) ) {
+	canvas.drawPath( m_screenPath, colour, thick );
+      }
       m_drawn = true;
       
       if ( drawJoints ) {
@@ -332,6 +417,21 @@ public:
     m_drawnBbox = m_screenBbox;
   }
 
+  /// as draw(), but queue the path on painter to be drawn with others
+  void draw( TiledPainter& painter, const Canvas& canvas, bool faded )
+  {
+    if ( m_hide < HIDE_STEPS ) {
+      int colour = canvas.makeColour(m_colour);
+      if ( faded ) {
+	colour = canvas.fadeColour(colour);
+      }
+      transform();
+      painter.add( m_screenPath, colour, canvas.width() > 400 );
+      m_drawn = true;
+    }
+    m_drawnBbox = m_screenBbox;
+  }
+
   void addPoint( const Vec2& pp ) 
   {
     Vec2 p = pp; p -= m_origin;
@@ -339,6 +439,7 @@ public:
     } else {
       m_rawPath.push_back( p );
       m_drawn = false;
+      forgetSprites();
     }
   }
 
@@ -410,6 +511,37 @@ public:
     return m_hide >= HIDE_STEPS;
   }
 
+  /// @return true if the stroke will stay put where it is drawn
+  bool isStatic()
+  {
+    return (m_attributes & (ATTRIB_GROUND|ATTRIB_DECOR))
+      && !(m_attributes & ATTRIB_DELETED)
+      && m_hide == 0;
+  }
+
+  bool hiding()
+  {
+    return m_hide > 0 && m_hide < HIDE_STEPS;
+  }
+
+  const Path& screenPath()
+  {
+    transform();
+    return m_screenPath;
+  }
+
+  int colour()
+  {
+    return m_colour;
+  }
+
+  /// account for a draw done elsewhere from a copy of the screen path
+  void markDrawn()
+  {
+    m_drawn = true;
+    m_drawnBbox = m_screenBbox;
+  }
+
   int numPoints()
   {
     return m_rawPath.numPoints();
@@ -438,6 +570,77 @@ private:
     }
   }
 
+  /// blit a moving stroke from the sprite cache, at the nearest of
+  /// m_spriteSteps orientations
+  /// @return false if it must be rasterized instead
+  bool drawSprite( Canvas& canvas, bool thick, bool faded )
+  {
+    SpriteCache& cache = SpriteCache::instance();
+    if ( !m_body || m_hide || isStatic() || cache.maxBytes() <= 0 ) {
+      return false;
+    }
+
+    Vec2 screenOrigin(0,0);
+    worldToScreen.transform( screenOrigin );
+    if ( m_spriteSteps == 0 ) {
+      // enough steps that the far end moves about a pixel between them
+      Vec2 unit(1000,0);
+      worldToScreen.transform( unit );
+      float32 scale = b2Vec2(unit - screenOrigin).Length() / 1000.0f;
+      float32 radius = 0;
+      for ( int i=0; i<m_rawPath.numPoints(); i++ ) {
+	radius = b2Max( radius, b2Vec2(m_rawPath.point(i)).Length() );
+      }
+      m_spriteSteps = b2Max( 8, (int)(2*M_PI*radius*scale) );
+    }
+
+    float32 angle = fmodf( m_body->GetAngle(), (float32)(2*M_PI) );
+    if ( angle < 0 ) {
+      angle += 2*M_PI;
+    }
+    SpriteCache::Key key;
+    key.owner = this;
+    key.angle = (int)(angle*m_spriteSteps/(2*M_PI) + 0.5f) % m_spriteSteps;
+    key.colour = faded ? (m_colour>>1) & 0x7f7f7f : m_colour;
+    key.thick = thick;
+
+    Vec2 pos( PIXELS_PER_METREf * m_body->GetPosition() );
+    worldToScreen.transform( pos );
+    if ( cache.draw( canvas, key, pos ) ) {
+      return true;
+    }
+    // A body turning by more than a step a frame would miss every time,
+    // paying for a sprite on top of the exact draw and churning the
+    // cache. Only make one for an orientation seen twice running, or
+    // for a body too slow to leave it before the next frame.
+    float32 stepsPerTick = fabsf( m_body->GetAngularVelocity() )
+      * m_spriteSteps / (2*M_PI) * ITERATION_TIMESTEPf;
+    bool repeat = key.angle == m_spriteMissAngle;
+    m_spriteMissAngle = key.angle;
+    if ( !repeat && stepsPerTick >= 0.5f ) {
+      return false;
+    }
+    // rasterized exactly this time, the sprite is for next time
+    Path rotated = m_rawPath;
+    rotated.rotate( b2Rot( key.angle*2*M_PI/m_spriteSteps ) );
+    Path sprite;
+    worldToScreen.transform( rotated, sprite );
+    sprite.translate( -screenOrigin );
+    cache.add( key, sprite );
+    return false;
+  }
+
+  void forgetSprites()
+  {
+    // only strokes that have drawn sprites touch the cache, so those
+    // built on a loader thread leave it alone
+    if ( m_spriteSteps ) {
+      SpriteCache::instance().forget( this );
+    }
+    m_spriteSteps = 0;
+    m_spriteMissAngle = -1;
+  }
+
   bool transform()
   {
     // distinguish between xformed raw and shape path as needed
@@ -496,18 +699,50 @@ private:
   b2Body*   m_body;
   bool      m_jointed[2];
   int       m_hide;
+  int       m_spriteSteps;  // orientations to cache sprites at, 0 = unknown
+  int       m_spriteMissAngle; // key.angle of the last sprite miss, -1 = none
 };
 
 
+StepPolicy::StepPolicy()
+  : maxSubSteps( 1 ),
+    contactsPerSubStep( CONTACTS_PER_SUBSTEP ),
+    velocityIterations( VELOCITY_ITERATIONS ),
+    positionIterations( POSITION_ITERATIONS ),
+    idleVelocityIterations( IDLE_VELOCITY_ITERATIONS ),
+    idlePositionIterations( IDLE_POSITION_ITERATIONS )
+{
+}
+
+StepPolicy& StepPolicy::defaults()
+{
+  static StepPolicy p;
+  return p;
+}
+
+
 Scene::Scene( bool noWorld )
   : m_world( NULL ),
     m_bgImage( NULL ),
+    m_staticLayer( NULL ),
+    m_staticBg( NULL ),
     m_protect( 0 ),
     m_gravity(0.0f, 0.0f),
     m_dynamicGravity(false),
     m_accelerometer(Os::get()->getAccelerometer()),
-    m_reset_sleepers(true)
+    m_stepPolicy(StepPolicy::defaults()),
+    m_reset_sleepers(true),
+    m_verifyHashes(false),
+    m_divergedAt(-1),
+    m_lock(SDL_CreateMutex()),
+    m_snapLock(SDL_CreateMutex()),
+    m_simThread(NULL),
+    m_front(0),
+    m_fullRedraw(false)
 {
+  SDL_AtomicSet( &m_simRunning, 0 );
+  SDL_AtomicSet( &m_simPaused, 0 );
+  SDL_AtomicSet( &m_simSpeed, 1 );
   if ( !noWorld ) {
     resetWorld();
   }
@@ -515,10 +750,14 @@ Scene::Scene( bool noWorld )
 
 Scene::~Scene()
 {
+  runThreaded( false );
+  SDL_DestroyMutex( m_snapLock );
+  SDL_DestroyMutex( m_lock );
   clear();
   if ( m_world ) {
     delete m_world;
   }
+  delete m_staticLayer;
 }
 
 void Scene::resetWorld()
@@ -530,6 +769,111 @@ void Scene::resetWorld()
   m_world->SetAllowSleeping(true);
   m_world->SetContactListener( this );
   m_reset_sleepers = true;
+  m_fullRedraw = true;
+}
+
+
+// The simulation runs for the life of the scene so it gets a thread of
+// its own rather than tying up a ThreadPool worker.
+int Scene::simulateThread( void* scene )
+{
+  ((Scene*)scene)->simulate();
+  return 0;
+}
+
+void Scene::runThreaded( bool threaded )
+{
+  if ( threaded && !m_simThread ) {
+    m_fullRedraw = true;
+    SDL_AtomicSet( &m_simRunning, 1 );
+    m_simThread = SDL_CreateThread( simulateThread, "simulation", this );
+  } else if ( !threaded && m_simThread ) {
+    SDL_AtomicSet( &m_simRunning, 0 );
+    SDL_WaitThread( m_simThread, NULL );
+    m_simThread = NULL;
+  }
+}
+
+void Scene::setPaused( bool paused )
+{
+  SDL_AtomicSet( &m_simPaused, paused ? 1 : 0 );
+}
+
+void Scene::setSpeed( int speed )
+{
+  SDL_AtomicSet( &m_simSpeed, speed < 0 ? 1 : speed );
+}
+
+void Scene::simulate()
+{
+  int owed = 0;
+  int clock = SDL_GetTicks();
+
+  while ( SDL_AtomicGet( &m_simRunning ) ) {
+    int speed = SDL_AtomicGet( &m_simSpeed );
+    int rate = ITERATION_RATE * ( speed > 0 ? speed : 1 );
+    int maxTicks = MAX_TICKS_PER_FRAME * ( speed > 0 ? speed : 1 );
+    int now = SDL_GetTicks();
+    owed += (now - clock) * rate;
+    clock = now;
+    if ( speed == 0 ) {
+      owed = maxTicks * 1000; // flat out: always a full batch to do
+    }
+
+    bool stepped = false;
+    for ( int ticks=0; owed >= 1000 && ticks < maxTicks; ticks++ ) {
+      Lock lock( *this );
+      bool paused = SDL_AtomicGet( &m_simPaused ) != 0;
+      if ( !isQuiescent( paused ) ) {
+	step( paused );
+	publish();
+	stepped = true;
+      }
+      owed -= 1000;
+    }
+    if ( owed >= 1000 ) {
+      owed = 0; // fallen behind, don't try to catch up
+    }
+    if ( speed > 0 || !stepped ) {
+      SDL_Delay( (1000 - owed) / rate + 1 );
+    }
+  }
+}
+
+void Scene::publish()
+{
+  // only this thread flips m_front so the back buffer is ours to fill
+  std::vector<StrokeSnapshot>& back = m_snapshot[1-m_front];
+  back.clear();
+  for ( size_t i=0; i<m_strokes.size(); i++ ) {
+    Stroke *s = m_strokes[i];
+    if ( !s->hidden() ) {
+      StrokeSnapshot ss;
+      ss.path = s->screenPath();
+      ss.bbox = s->screenBbox();
+      ss.colour = s->colour();
+      ss.stroke = s;
+      ss.fixed = s->isStatic();
+      back.push_back( ss );
+    }
+    s->markDrawn();
+  }
+  Rect dirty = m_dirtyArea;
+  if ( m_fullRedraw ) {
+    dirty = FULLSCREEN_RECT;
+    m_fullRedraw = false;
+  }
+  dirty.clipTo( FULLSCREEN_RECT );
+
+  SDL_LockMutex( m_snapLock );
+  m_front = 1-m_front;
+  m_snapDirty.expand( dirty );
+  SDL_UnlockMutex( m_snapLock );
+
+  while ( m_deletedStrokes.size() ) {
+    delete m_deletedStrokes[0];
+    m_deletedStrokes.erase( m_deletedStrokes.begin() );
+  }
 }
 
 Stroke* Scene::newStroke( const Path& p, int colour, int attribs ) {
@@ -686,7 +1030,7 @@ void Scene::step( bool isPaused )
       }
     }
 
-    m_world->Step( ITERATION_TIMESTEPf, VELOCITY_ITERATIONS, POSITION_ITERATIONS );
+    stepWorld();
     
     if (m_reset_sleepers)
     {
@@ -715,9 +1059,216 @@ void Scene::step( bool isPaused )
       }
     }
   }
+
+  if ( STATE_HASH_TICKS > 0 && m_recorder.isRunning()
+       && m_recorder.ticks() % STATE_HASH_TICKS == 0 ) {
+    m_log.addHash( m_recorder.ticks(), stateHash() );
+  }
+  if ( m_verifyHashes && m_divergedAt < 0 && m_player.isRunning() ) {
+    unsigned h;
+    if ( m_log.findHash( m_player.ticks(), h ) && h != stateHash() ) {
+      m_divergedAt = m_player.ticks();
+    }
+  }
+
+  if ( m_player.isRunning()
+       && m_player.ticks() % REPLAY_KEYFRAME_TICKS == 0
+       && !m_log.hasKeyframe( m_player.ticks() ) ) {
+    ScriptKeyframe k;
+    snapshot( k );
+    m_log.addKeyframe( k );
+  }
   calcDirtyArea();
 }
 
+bool Scene::isQuiescent( bool isPaused )
+{
+  if ( !m_world || m_reset_sleepers
+       || ( isThreaded() && m_fullRedraw )
+       || ( m_accelerometer && m_dynamicGravity )
+       || m_deletedStrokes.size() || !m_dirtyArea.isEmpty() ) {
+    return false;
+  }
+  if ( m_recorder.isRunning() && m_recorder.isPaused() != isPaused ) {
+    return false; // pause change still to be recorded
+  }
+  if ( m_player.isRunning() ) {
+    if ( !m_player.isFinished() ) {
+      return false;
+    }
+    isPaused |= m_player.isPaused();
+  }
+  for ( size_t i=0; i<m_strokes.size(); i++ ) {
+    if ( m_strokes[i]->hiding()
+	 || m_strokes[i]->hasAttribute(ATTRIB_DELETED)
+	 || m_strokes[i]->isDirty() ) {
+      return false;
+    }
+  }
+  if ( !isPaused ) {
+    for ( b2Body* b = m_world->GetBodyList(); b; b = b->GetNext() ) {
+      if ( b->GetType() == b2_dynamicBody && b->IsAwake() ) {
+	return false;
+      }
+    }
+  }
+  return true;
+}
+
+void Scene::stepWorld()
+{
+  bool awake = false;
+  for ( b2Body* b = m_world->GetBodyList(); b && !awake; b = b->GetNext() ) {
+    awake = b->GetType() == b2_dynamicBody && b->IsAwake();
+  }
+  if ( !awake ) {
+    // nothing to solve, keep the step as cheap as possible
+    m_world->Step( ITERATION_TIMESTEPf,
+		   m_stepPolicy.idleVelocityIterations,
+		   m_stepPolicy.idlePositionIterations );
+    return;
+  }
+
+  int subSteps = 1;
+  if ( m_stepPolicy.maxSubSteps > 1 && m_stepPolicy.contactsPerSubStep > 0 ) {
+    int touching = 0;
+    for ( b2Contact* c = m_world->GetContactList(); c; c = c->GetNext() ) {
+      if ( c->IsTouching() ) {
+	touching++;
+      }
+    }
+    subSteps += touching / m_stepPolicy.contactsPerSubStep;
+    if ( subSteps > m_stepPolicy.maxSubSteps ) {
+      subSteps = m_stepPolicy.maxSubSteps;
+    }
+  }
+  for ( int i=0; i<subSteps; i++ ) {
+    m_world->Step( ITERATION_TIMESTEPf / subSteps,
+		   m_stepPolicy.velocityIterations,
+		   m_stepPolicy.positionIterations );
+  }
+}
+
+static inline void hashBits( unsigned& h, float32 f )
+{
+  unsigned bits;
+  memcpy( &bits, &f, sizeof(bits) );
+  for ( int i=0; i<4; i++ ) {
+    h ^= (bits >> (i*8)) & 0xff;
+    h *= 16777619u;  // FNV-1a
+  }
+}
+
+unsigned Scene::stateHash()
+{
+  unsigned h = 2166136261u;
+  for ( size_t i=0; i<m_strokes.size(); i++ ) {
+    b2Body* b = m_strokes[i]->body();
+    if ( b ) {
+      hashBits( h, b->GetPosition().x );
+      hashBits( h, b->GetPosition().y );
+      hashBits( h, b->GetAngle() );
+      hashBits( h, b->GetLinearVelocity().x );
+      hashBits( h, b->GetLinearVelocity().y );
+      hashBits( h, b->GetAngularVelocity() );
+    }
+  }
+  return h;
+}
+
+void Scene::snapshot( ScriptKeyframe& k )
+{
+  k.t = m_player.ticks();
+  k.isPaused = m_player.isPaused();
+  k.gravity = m_world->GetGravity();
+  k.dynamicGravity = m_dynamicGravity;
+  k.strokes.resize( m_strokes.size() );
+  for ( size_t i=0; i<m_strokes.size(); i++ ) {
+    m_strokes[i]->saveState( k.strokes[i] );
+  }
+  k.joints.clear();
+  for ( b2Joint* j = m_world->GetJointList(); j; j = j->GetNext() ) {
+    JointState js;
+    js.strokeA = indexOf( m_strokes, (Stroke*)j->GetBodyA()->GetUserData() );
+    js.strokeB = indexOf( m_strokes, (Stroke*)j->GetBodyB()->GetUserData() );
+    js.anchor = j->GetAnchorA();
+    if ( js.strokeA >= 0 && js.strokeB >= 0 ) {
+      k.joints.push_back( js );
+    }
+  }
+}
+
+void Scene::restore( const ScriptKeyframe& k )
+{
+  // the old bodies go down with the old world
+  while ( m_strokes.size() ) {
+    delete m_strokes[m_strokes.size()-1];
+    m_strokes.pop_back();
+  }
+  while ( m_deletedStrokes.size() ) {
+    delete m_deletedStrokes[0];
+    m_deletedStrokes.erase( m_deletedStrokes.begin() );
+  }
+  resetWorld();
+  m_reset_sleepers = false;
+  m_dynamicGravity = k.dynamicGravity;
+  m_currentGravity = k.gravity;
+  m_world->SetGravity( m_currentGravity );
+
+  for ( size_t i=0; i<k.strokes.size(); i++ ) {
+    Stroke *s = new Stroke( k.strokes[i] );
+    m_strokes.push_back( s );
+    if ( k.strokes[i].hasBody ) {
+      s->createBodies( *m_world );
+    }
+    s->restoreState( k.strokes[i] );
+  }
+  // joint list is newest first, recreate in the original order
+  for ( int i=k.joints.size()-1; i>=0; i-- ) {
+    const JointState& j = k.joints[i];
+    m_strokes[j.strokeA]->join( m_world, m_strokes[j.strokeB], j.anchor );
+  }
+  m_player.seek( k.t, k.isPaused );
+  // a restored keyframe is only approximate, hashes no longer apply
+  m_verifyHashes = false;
+}
+
+void Scene::rewind()
+{
+  // reload the level just as a fresh replay would, keeping the log and
+  // the keyframes already taken from it
+  ScriptLog log;
+  log.swap( m_log );
+  std::string source( m_source );
+  std::istringstream in( source );
+  load( in );
+  m_log.swap( log );
+  start( true );
+  m_fullRedraw = true;
+}
+
+bool Scene::seek( int tick, int maxSteps )
+{
+  if ( !m_player.isRunning() ) {
+    return false;
+  }
+  if ( tick < 0 ) {
+    tick = 0;
+  }
+  const ScriptKeyframe* k = m_log.findKeyframe( tick );
+  if ( tick < m_player.ticks() || ( k && k->t > m_player.ticks() ) ) {
+    if ( k ) {
+      restore( *k );
+    } else {
+      rewind();
+    }
+  }
+  while ( m_player.ticks() < tick && maxSteps-- > 0 ) {
+    step();
+  }
+  return m_player.ticks() >= tick;
+}
+
 // b2ContactListener callback when a new contact is detected
 void Scene::BeginContact(b2Contact* contact)
 {     
@@ -750,6 +1301,12 @@ bool Scene::isCompleted()
 
 Rect Scene::dirtyArea()
 {
+  if ( isThreaded() ) {
+    SDL_LockMutex( m_snapLock );
+    Rect r = m_snapDirty;
+    SDL_UnlockMutex( m_snapLock );
+    return r;
+  }
   return m_dirtyArea;
 }
 
@@ -766,7 +1323,7 @@ void Scene::calcDirtyArea()
   }
   for ( size_t i=0; i<m_deletedStrokes.size(); i++ ) {
     // acumulate new areas to draw
-    r.expand( m_strokes[i]->lastDrawnBbox() );
+    r.expand( m_deletedStrokes[i]->lastDrawnBbox() );
   }
   if ( !r.isEmpty() ) {
     // expand to allow for thick lines
@@ -774,24 +1331,120 @@ void Scene::calcDirtyArea()
   }
   m_dirtyArea = r;
 }
-void Scene::draw( Canvas& canvas, const Rect& area )
+bool Scene::StaticStroke::operator==( const StaticStroke& o ) const
 {
+  return stroke == o.stroke && points == o.points && colour == o.colour
+    && bbox.tl == o.bbox.tl && bbox.br == o.bbox.br;
+}
+
+void Scene::updateStaticLayer( Canvas& canvas, bool thick )
+{
+  std::vector<StaticStroke> current;
+  if ( isThreaded() ) {
+    const std::vector<StrokeSnapshot>& front = m_snapshot[m_front];
+    for ( size_t i=0; i<front.size(); i++ ) {
+      if ( front[i].fixed ) {
+	StaticStroke ss = { front[i].stroke, &front[i].path, front[i].bbox,
+			    front[i].path.numPoints(), front[i].colour };
+	current.push_back( ss );
+      }
+    }
+  } else {
+    for ( size_t i=0; i<m_strokes.size(); i++ ) {
+      Stroke* s = m_strokes[i];
+      if ( s->isStatic() ) {
+	StaticStroke ss = { s, &s->screenPath(), s->screenBbox(),
+			    s->screenPath().numPoints(), s->colour() };
+	current.push_back( ss );
+      }
+    }
+  }
+
+  if ( m_staticLayer
+       && m_staticLayer->width() == canvas.width()
+       && m_staticLayer->height() == canvas.height()
+       && m_staticBg == m_bgImage
+       && current == m_staticStrokes ) {
+    return;
+  }
+
+  delete m_staticLayer;
+  m_staticLayer = canvas.compatible();
   if ( m_bgImage ) {
-    canvas.setBackground( m_bgImage );
+    m_staticLayer->setBackground( m_bgImage );
+  } else {
+    m_staticLayer->setBackground( 0 );
+  }
+  m_staticLayer->clear();
+  TiledPainter painter;
+  for ( size_t i=0; i<current.size(); i++ ) {
+    painter.add( *current[i].path,
+		 m_staticLayer->makeColour(current[i].colour), thick );
+  }
+  painter.paint( *m_staticLayer, Rect(0,0,canvas.width()-1,canvas.height()-1) );
+  for ( size_t i=0; i<current.size(); i++ ) {
+    current[i].path = NULL; // not kept past this draw
+  }
+  m_staticStrokes.swap( current );
+  m_staticBg = m_bgImage;
+}
+
+void Scene::draw( Canvas& canvas, const Rect& area, bool faded )
+{
+  bool thick = (canvas.width() > 400);
+  if ( isThreaded() ) {
+    SDL_LockMutex( m_snapLock );
+  }
+  if ( faded ) {
+    if ( m_bgImage ) {
+      canvas.setBackground( m_bgImage );
+    } else {
+      canvas.setBackground( 0 );
+    }
+    canvas.clearFaded( area );
   } else {
-    canvas.setBackground( 0 );
-  }
-  canvas.clear( area );
-  Rect clipArea = area;
-  clipArea.tl.x--;
-  clipArea.tl.y--;
-  clipArea.br.x++;
-  clipArea.br.y++;
+    // ground and decor come back with the background in one blit
+    updateStaticLayer( canvas, thick );
+    canvas.setBackground( m_staticLayer );
+    canvas.clear( area );
+    canvas.setBackground( m_bgImage );
+  }
+
+  // big redraws are split into tiles drawn in parallel, which leaves
+  // small ones to the sprite cache
+  TiledPainter painter;
+  if ( isThreaded() ) {
+    const std::vector<StrokeSnapshot>& front = m_snapshot[m_front];
+    for ( size_t i=0; i<front.size(); i++ ) {
+      if ( (faded || !front[i].fixed) && area.intersects( front[i].bbox ) ) {
+	int colour = canvas.makeColour(front[i].colour);
+	if ( faded ) {
+	  colour = canvas.fadeColour(colour);
+	}
+	painter.add( front[i].path, colour, thick );
+      }
+    }
+    painter.paint( canvas, area );
+    if ( area.contains( m_snapDirty ) ) {
+      m_snapDirty.clear();
+    }
+    SDL_UnlockMutex( m_snapLock );
+    return;
+  }
+  bool tiled = TiledPainter::worthwhile( area );
   for ( size_t i=0; i<m_strokes.size(); i++ ) {
-    if ( area.intersects( m_strokes[i]->screenBbox() ) ) {
-	m_strokes[i]->draw( canvas );
+    if ( !faded && m_strokes[i]->isStatic() ) {
+      // already on the static layer
+      m_strokes[i]->markDrawn();
+    } else if ( !area.intersects( m_strokes[i]->screenBbox() ) ) {
+      continue;
+    } else if ( tiled ) {
+      m_strokes[i]->draw( painter, canvas, faded );
+    } else {
+      m_strokes[i]->draw( canvas, false, faded );
     }
   }
+  painter.paint( canvas, area );
   while ( m_deletedStrokes.size() ) {
     delete m_deletedStrokes[0];
     m_deletedStrokes.erase(m_deletedStrokes.begin());
@@ -800,6 +1453,9 @@ void Scene::draw( Canvas& canvas, const Rect& area )
 
 void Scene::reset( Stroke* s, bool purgeUnprotected )
 {
+  if ( purgeUnprotected ) {
+    m_fullRedraw = true;
+  }
   while ( purgeUnprotected && m_strokes.size() > static_cast<size_t>(m_protect) ) {
     m_strokes[m_strokes.size()-1]->reset(m_world);
     m_strokes.erase( --m_strokes.end() );
@@ -833,7 +1489,7 @@ void Scene::clear()
   }
   while ( m_deletedStrokes.size() ) {
     delete m_deletedStrokes[0];
-    m_deletedStrokes.erase(m_strokes.begin());
+    m_deletedStrokes.erase(m_deletedStrokes.begin());
   }
   if ( m_world ) {
     //step is required to actually destroy bodies and joints
@@ -889,27 +1545,74 @@ bool Scene::load( std::istream& in )
   clear();
   resetWorld();
   m_dynamicGravity = false;
-  if ( g_bgImage==NULL ) {
-    g_bgImage = new Image("paper.png");
-    g_bgImage->scale( SCREEN_WIDTH, SCREEN_HEIGHT );
-  }
-  m_bgImage = g_bgImage;
+  m_bgImage = background( SCREEN_WIDTH, SCREEN_HEIGHT );
+  m_source.clear();
   std::string line;
   while ( !in.eof() ) {
     getline( in, line );
     parseLine( line );
+    if ( line.size() && line[0] != 'E' && line[0] != 'H' ) {
+      m_source += line + '\n';
+    }
   }
   protect();
   return true;
 }
 
 
+void Scene::prepare()
+{
+  activateAll();
+}
+
+void Scene::swap( Scene& other )
+{
+  std::swap( m_world, other.m_world );
+  m_strokes.swap( other.m_strokes );
+  m_deletedStrokes.swap( other.m_deletedStrokes );
+  m_title.swap( other.m_title );
+  m_author.swap( other.m_author );
+  m_bg.swap( other.m_bg );
+  m_source.swap( other.m_source );
+  m_log.swap( other.m_log );
+  std::swap( m_bgImage, other.m_bgImage );
+  std::swap( m_staticLayer, other.m_staticLayer );
+  std::swap( m_staticBg, other.m_staticBg );
+  m_staticStrokes.swap( other.m_staticStrokes );
+  std::swap( m_protect, other.m_protect );
+  std::swap( m_gravity, other.m_gravity );
+  std::swap( m_currentGravity, other.m_currentGravity );
+  std::swap( m_dynamicGravity, other.m_dynamicGravity );
+  std::swap( m_reset_sleepers, other.m_reset_sleepers );
+
+  // contacts are reported to whichever scene now owns the world
+  if ( m_world ) {
+    m_world->SetContactListener( this );
+  }
+  if ( other.m_world ) {
+    other.m_world->SetContactListener( &other );
+  }
+  m_recorder.stop();
+  m_player.stop();
+  other.m_recorder.stop();
+  other.m_player.stop();
+  m_verifyHashes = other.m_verifyHashes = false;
+  m_divergedAt = other.m_divergedAt = -1;
+  m_dirtyArea.clear();
+  other.m_dirtyArea.clear();
+  m_fullRedraw = other.m_fullRedraw = true;
+}
+
 void Scene::start( bool replay )
 {
   activateAll();
+  // a replay must see the same sleeper handling as the original run
+  m_reset_sleepers = true;
   if ( replay ) {
     m_recorder.stop();
     m_player.start( &m_log, this );
+    m_verifyHashes = true;
+    m_divergedAt = -1;
   } else {
     m_player.stop();
     m_recorder.start( &m_log );
@@ -927,6 +1630,7 @@ bool Scene::parseLine( const std::string& line )
     case 'S': m_strokes.push_back( new Stroke(line) );     return true;
     case 'G': setGravity(line);                         return true;
     case 'E': m_log.append(line.substr(line.find(':')+1));return true;
+    case 'H': m_log.appendHash(line.substr(line.find(':')+1));return true;
     }
   } catch ( const char* e ) {
       throw std::invalid_argument(std::string("Stroke error: ") + e);
@@ -954,6 +1658,9 @@ bool Scene::save( const std::string& file, bool saveLog )
       for ( size_t i=0; i<m_log.size(); i++ ) {
 	o << "E: " << m_log.asString( i ) <<std::endl;
       }
+      for ( size_t i=0; i<m_log.numHashes(); i++ ) {
+	o << "H: " << m_log.hashString( i ) <<std::endl;
+      }
     }
 
     o.close();
@@ -964,5 +1671,27 @@ bool Scene::save( const std::string& file, bool saveLog )
 }
 
 
-Image *Scene::g_bgImage = NULL;
+Canvas* Scene::background( int w, int h )
+{
+  // levels may load on a ThreadPool worker
+  static SDL_mutex* lock = SDL_CreateMutex();
+  static Image* paper = NULL;
+  static std::map<std::pair<int,int>,Canvas*> scaled;
+
+  SDL_LockMutex( lock );
+  if ( paper == NULL ) {
+    paper = new Image("paper.png");
+  }
+  Canvas*& bg = scaled[std::make_pair(w,h)];
+  if ( bg == NULL ) {
+    if ( paper->width() == w && paper->height() == h ) {
+      bg = paper;
+    } else {
+      bg = paper->scaled( w, h );
+    }
+  }
+  Canvas* c = bg;
+  SDL_UnlockMutex( lock );
+  return c;
+}
 
@@ -21,6 +21,7 @@
 #include <string>
 #include <fstream>
 #include <vector>
+#include <climits>
 
 class Stroke;
 class b2World;
@@ -40,6 +41,31 @@ typedef enum {
 } Attribute;
 
 
+/**
+ * @brief How Scene::step spends each fixed ITERATION_RATE tick in box2d
+ *
+ * The defaults give one solver step per tick. Recorded demos and state
+ * hashes are only reproducible under the policy they were made with.
+ */
+struct StepPolicy
+{
+  StepPolicy();
+
+  /// upper bound on solver steps per tick
+  int maxSubSteps;
+  /// add a sub-step for every this many touching contacts, 0 = never
+  int contactsPerSubStep;
+  int velocityIterations;
+  int positionIterations;
+  /// iterations used while no dynamic body is awake
+  int idleVelocityIterations;
+  int idlePositionIterations;
+
+  /// policy given to newly created scenes
+  static StepPolicy& defaults();
+};
+
+
 class Scene : private b2ContactListener
 {
 public:
@@ -63,9 +89,16 @@ public:
   }
 
   void step( bool isPaused=false );
+  /// @return true if stepping cannot change anything until there is new
+  /// input: all bodies asleep, nothing hiding or redrawing, no replay
+  /// entries pending
+  bool isQuiescent( bool isPaused=false );
+  const StepPolicy& stepPolicy() const { return m_stepPolicy; }
+  void stepPolicy( const StepPolicy& p ) { m_stepPolicy = p; }
   bool isCompleted();
   Rect dirtyArea();
-  void draw( Canvas& canvas, const Rect& area );
+  /// @param faded draw as Canvas::fade() would leave it, without the fade
+  void draw( Canvas& canvas, const Rect& area, bool faded=false );
   void reset( Stroke* s=NULL,  bool purgeUnprotected=false );
   Stroke* strokeAtPoint( const Vec2 pt, float32 max );
   void clear();
@@ -77,18 +110,70 @@ public:
   bool load( const std::string& file );
   bool load( std::istream& in );
   void start( bool replay=false );
+  /// Create bodies and joints for a freshly loaded scene ahead of
+  /// start(). Touches nothing shared so may run off the main thread.
+  void prepare();
+  /// Exchange level contents with another scene. Neither scene may be
+  /// running; call start() afterwards.
+  void swap( Scene& other );
   void protect( int n=-1 );
   bool save( const std::string& file, bool saveLog=false );
 
+  /**
+   * @brief Run step() on a simulation thread of its own
+   *
+   * While threaded the scene steps itself at ITERATION_RATE times the
+   * speed set by setSpeed() and after
+   * each step publishes a copy of the stroke screen paths. draw() and
+   * dirtyArea() only read the published copy; every other call must be
+   * made holding a Scene::Lock.
+   */
+  void runThreaded( bool threaded );
+  bool isThreaded() const { return m_simThread != NULL; }
+  /// pause state for the simulation thread to step with
+  void setPaused( bool paused );
+  /// ticks per ITERATION_RATE tick for the simulation thread, 0 = flat out
+  void setSpeed( int speed );
+  /// simulation thread body
+  void simulate();
+  static int simulateThread( void* scene );
+
+  class Lock
+  {
+  public:
+    Lock( Scene& s ) : m_scene(s) { SDL_LockMutex( m_scene.m_lock ); }
+    ~Lock() { SDL_UnlockMutex( m_scene.m_lock ); }
+  private:
+    Scene& m_scene;
+  };
+
   ScriptLog* getLog() { return &m_log; }
   const ScriptPlayer* replay() { return &m_player; }
+
+  /// Move a running replay towards the end of the given tick, restoring
+  /// the nearest earlier keyframe and simulating forward from there, at
+  /// most maxSteps ticks per call.
+  /// @return true once the replay has reached the tick, false while it
+  /// still has ticks to go or if no replay is running
+  bool seek( int tick, int maxSteps=INT_MAX );
+
+  /// @return hash of every body's position, angle and velocity
+  unsigned stateHash();
+  /// @return first tick at which a replay differed from the recorded
+  /// state hashes, or -1
+  int divergedAt() const { return m_divergedAt; }
 private:
   void resetWorld();
+  void rewind();
+  void snapshot( ScriptKeyframe& k );
+  void restore( const ScriptKeyframe& k );
   bool activate( Stroke *s );
   void activateAll();
   void createJoints( Stroke *s );
   bool parseLine( const std::string& line );
   void calcDirtyArea();
+  void stepWorld();
+  void publish();
 
   // b2ContactListener callback when a new contact is detected
   virtual void BeginContact(b2Contact* contact) ;
@@ -98,17 +183,35 @@ private:
   std::vector<Stroke*>  m_strokes;
   std::vector<Stroke*>  m_deletedStrokes;
   std::string     m_title, m_author, m_bg;
+  std::string     m_source;  // the level as loaded, without its log
   ScriptLog       m_log;
   ScriptRecorder  m_recorder;
   ScriptPlayer    m_player;
-  Image          *m_bgImage;
-  static Image   *g_bgImage;
+  Canvas         *m_bgImage;
+  /// paper.png scaled to w x h, made once per size and kept
+  static Canvas* background( int w, int h );
+
+  /// what a static layer was drawn from, to tell when it is stale
+  struct StaticStroke {
+    const Stroke* stroke;
+    const Path*   path;   // only while drawing the layer
+    Rect          bbox;
+    int           points;
+    int           colour;
+    bool operator==( const StaticStroke& o ) const;
+  };
+  /// redraw m_staticLayer if the static strokes or canvas have changed
+  void updateStaticLayer( Canvas& canvas, bool thick );
+  Canvas         *m_staticLayer;  // background plus static strokes
+  Canvas         *m_staticBg;     // the background it was drawn on
+  std::vector<StaticStroke> m_staticStrokes;
   int             m_protect;
   b2Vec2          m_gravity;
   b2Vec2          m_currentGravity;
   bool            m_dynamicGravity;
   Accelerometer  *m_accelerometer;
   Rect            m_dirtyArea;
+  StepPolicy      m_stepPolicy;
   
   // Box2D 2.0.1 allows dynamic bodies in the world to be created sleeping and remain in that state
   // until contact is made.  On the other hand, Box2D 2.3.1 will wake up some or all of these bodies
@@ -117,6 +220,27 @@ private:
   // Scene is created or reset to cause the sleeping flag to be reset after one simulation step.
   //
   bool            m_reset_sleepers;
+
+  bool            m_verifyHashes;
+  int             m_divergedAt;
+
+  struct StrokeSnapshot {
+    Path path;
+    Rect bbox;
+    int  colour;
+    const Stroke* stroke; // identity only, may be gone by draw time
+    bool fixed;           // Stroke::isStatic()
+  };
+  SDL_mutex      *m_lock;       // recursive, guards everything below but
+  SDL_mutex      *m_snapLock;   // the published snapshot and its dirt
+  SDL_Thread     *m_simThread;
+  SDL_atomic_t    m_simRunning;
+  SDL_atomic_t    m_simPaused;
+  SDL_atomic_t    m_simSpeed;
+  std::vector<StrokeSnapshot> m_snapshot[2];
+  int             m_front;
+  Rect            m_snapDirty;
+  bool            m_fullRedraw;
 };
 
 
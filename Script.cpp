@@ -72,7 +72,94 @@ void ScriptLog::append( const std::string& str )
   push_back( ScriptEntry(str) );
 }
 
+void ScriptLog::clear()
+{
+  std::vector<ScriptEntry>::clear();
+  m_keyframes.clear();
+  m_hashes.clear();
+}
+
+void ScriptLog::swap( ScriptLog& other )
+{
+  std::vector<ScriptEntry>::swap( other );
+  m_keyframes.swap( other.m_keyframes );
+  m_hashes.swap( other.m_hashes );
+}
+
+std::size_t ScriptLog::indexAfter( int t ) const
+{
+  std::size_t i = 0;
+  while ( i < size() && at(i).t <= t ) {
+    i++;
+  }
+  return i;
+}
+
+void ScriptLog::addKeyframe( const ScriptKeyframe& k )
+{
+  std::vector<ScriptKeyframe>::iterator it = m_keyframes.begin();
+  while ( it != m_keyframes.end() && it->t < k.t ) {
+    ++it;
+  }
+  if ( it == m_keyframes.end() || it->t != k.t ) {
+    m_keyframes.insert( it, k );
+  }
+}
+
+bool ScriptLog::hasKeyframe( int t ) const
+{
+  const ScriptKeyframe* k = findKeyframe( t );
+  return k && k->t == t;
+}
+
+const ScriptKeyframe* ScriptLog::findKeyframe( int t ) const
+{
+  const ScriptKeyframe* best = NULL;
+  for ( std::size_t i=0; i<m_keyframes.size() && m_keyframes[i].t <= t; i++ ) {
+    best = &m_keyframes[i];
+  }
+  return best;
+}
+
+
+void ScriptLog::addHash( int t, unsigned hash )
+{
+  StateHash h;
+  h.t = t;
+  h.hash = hash;
+  m_hashes.push_back( h );
+}
+
+bool ScriptLog::findHash( int t, unsigned& hash ) const
+{
+  for ( std::size_t i=0; i<m_hashes.size() && m_hashes[i].t <= t; i++ ) {
+    if ( m_hashes[i].t == t ) {
+      hash = m_hashes[i].hash;
+      return true;
+    }
+  }
+  return false;
+}
+
+std::string ScriptLog::hashString( std::size_t i ) const
+{
+  if ( i < m_hashes.size() ) {
+    char buf[32];
+    sprintf( buf, "%d,%08x", m_hashes[i].t, m_hashes[i].hash );
+    return std::string( buf );
+  }
+  return std::string();
+}
 
+void ScriptLog::appendHash( const std::string& str )
+{
+  int t;
+  unsigned hash;
+  if ( sscanf(str.c_str(), "%d,%x", &t, &hash) != 2 ) {
+    throw std::invalid_argument("badly formed state hash");
+  }
+  addHash( t, hash );
+}
 
 ScriptRecorder::ScriptRecorder()
   : m_running(false),
@@ -113,35 +200,38 @@ void ScriptRecorder::tick(bool isPaused)
 }
 
 
+// User edits land between ticks and first affect the world on the next
+// step, which is when the player must apply them too.
+
 void ScriptRecorder::newStroke( const Path& p, int colour, int attribs )
 {
   if ( m_running )
-    m_log->append( m_lastTick, ScriptEntry::OP_NEW, 0, colour, attribs, p[0] );
+    m_log->append( m_lastTick+1, ScriptEntry::OP_NEW, 0, colour, attribs, p[0] );
 }
 
 
 void ScriptRecorder::deleteStroke( int index )
 {
   if ( m_running )
-    m_log->append( m_lastTick, ScriptEntry::OP_DELETE, index );
+    m_log->append( m_lastTick+1, ScriptEntry::OP_DELETE, index );
 }
 
 void ScriptRecorder::extendStroke( int index, const Vec2& pt )
 {
   if ( m_running )
-    m_log->append( m_lastTick, ScriptEntry::OP_EXTEND, index, 0, 0, pt );
+    m_log->append( m_lastTick+1, ScriptEntry::OP_EXTEND, index, 0, 0, pt );
 }
 
 void ScriptRecorder::moveStroke( int index, const Vec2& pt )
 {
   if ( m_running )
-    m_log->append( m_lastTick, ScriptEntry::OP_MOVE, index, 0, 0, pt );
+    m_log->append( m_lastTick+1, ScriptEntry::OP_MOVE, index, 0, 0, pt );
 }
 
 void ScriptRecorder::activateStroke( int index )
 {
   if ( m_running )
-    m_log->append( m_lastTick, ScriptEntry::OP_ACTIVATE, index );
+    m_log->append( m_lastTick+1, ScriptEntry::OP_ACTIVATE, index );
 }
 
 void ScriptRecorder::goal( int goalNum )
@@ -152,6 +242,16 @@ void ScriptRecorder::goal( int goalNum )
 
 
 
+ScriptPlayer::ScriptPlayer()
+  : m_playing(false),
+    m_isPaused(false),
+    m_log(NULL),
+    m_scene(NULL),
+    m_index(0),
+    m_lastTick(0)
+{
+}
+
 void ScriptPlayer::start( const ScriptLog* log, Scene* scene )
 {
   m_playing = true;
@@ -169,6 +269,15 @@ void ScriptPlayer::stop()
   m_log = NULL;
 }
 
+void ScriptPlayer::seek( int t, bool isPaused )
+{
+  if ( m_log ) {
+    m_lastTick = t;
+    m_isPaused = isPaused;
+    m_index = m_log->indexAfter( t );
+  }
+}
+
 bool ScriptPlayer::isRunning() const
 {
   return m_log && m_log->size() > 0 && m_playing; 
@@ -52,6 +52,46 @@ struct ScriptEntry {
 };
 
 
+/// Complete state of a single stroke as captured in a keyframe.
+struct StrokeState {
+  Path    path;		// raw path, absolute world coordinates
+  int     colour;
+  int     attributes;
+  bool    jointed[2];
+  int     hide;
+  Path    screenPath;	// only kept while a hide animation is running
+  bool    hasBody;
+  b2Vec2  position;
+  float32 angle;
+  b2Vec2  linearVelocity;
+  float32 angularVelocity;
+  bool    awake;
+};
+
+/// A revolute joint between two strokes, identified by index.
+struct JointState {
+  int    strokeA;
+  int    strokeB;
+  b2Vec2 anchor;	// world anchor on strokeA, in metres
+};
+
+/**
+ * @brief Full world snapshot taken at the end of tick t of a replay.
+ *
+ * Restoring a keyframe and playing on from there is close to, but not
+ * bit-identical with, simulating from tick 0 as box2d's contact cache
+ * is not part of the snapshot.
+ */
+struct ScriptKeyframe {
+  int  t;
+  bool isPaused;
+  b2Vec2 gravity;
+  bool dynamicGravity;
+  std::vector<StrokeState> strokes;
+  std::vector<JointState> joints;
+};
+
+
 class ScriptLog : public std::vector<ScriptEntry>
 {
 public:
@@ -59,6 +99,33 @@ public:
   void append( int tick, ScriptEntry::Op op, int stroke=-1,
 	       int arg1=-1, int arg2=-1, const Vec2& pt=Vec2(-1,-1) );
   void append( const std::string& str ); 
+  void clear();
+  void swap( ScriptLog& other );
+
+  /// @return index of the first entry to be played after tick t
+  std::size_t indexAfter( int t ) const;
+
+  void addKeyframe( const ScriptKeyframe& k );
+  bool hasKeyframe( int t ) const;
+  /// @return the latest keyframe taken at or before tick t, or NULL
+  const ScriptKeyframe* findKeyframe( int t ) const;
+  std::size_t numKeyframes() const { return m_keyframes.size(); }
+
+  /// state hashes are saved with the log so replays can be verified
+  void addHash( int t, unsigned hash );
+  bool findHash( int t, unsigned& hash ) const;
+  std::string hashString( std::size_t i ) const;
+  void appendHash( const std::string& str );
+  std::size_t numHashes() const { return m_hashes.size(); }
+  int lastHashTick() const { return m_hashes.size() ? m_hashes.back().t : 0; }
+
+private:
+  struct StateHash {
+    int t;
+    unsigned hash;
+  };
+  std::vector<ScriptKeyframe> m_keyframes;
+  std::vector<StateHash> m_hashes;
 };
 
 
@@ -77,6 +144,9 @@ public:
   void goal( int goalNum );
 
   ScriptLog* getLog() { return m_log; }
+  bool isRunning() const { return m_running; }
+  bool isPaused() const { return m_isPaused; }
+  int  ticks() const { return m_lastTick; }
 
 private:
   bool          m_running;
@@ -89,11 +159,17 @@ private:
 class ScriptPlayer
 {
 public:
-
+  ScriptPlayer();
   void start( const ScriptLog* log, Scene* scene );
   bool isRunning() const;
   void stop();
   bool tick(); 
+  /// Continue playback from the end of tick t
+  void seek( int t, bool isPaused );
+  int  ticks() const { return m_lastTick; }
+  bool isPaused() const { return m_isPaused; }
+  /// @return true once every entry in the log has been played
+  bool isFinished() const { return !m_log || m_index >= m_log->size(); }
 
 private:
   bool           m_playing;
@@ -149,9 +149,13 @@ void Label::text( const std::string& s )
 void Label::draw( Canvas& screen, const Rect& area )
 {
   Widget::draw(screen,area);
-  screen.setClip(area.tl.x,area.tl.y,area.width(),area.height());
-  m_font->drawCenter( &screen, m_pos.centroid(), m_text, m_fg);
-  screen.resetClip();
+  Canvas* text = TextCache::instance().get( m_font, m_text, m_fg );
+  if (text) {
+    screen.setClip(area.tl.x,area.tl.y,area.width(),area.height());
+    Vec2 pt = m_pos.centroid() - Vec2(text->width(),text->height())/2;
+    screen.drawImage( text, pt.x, pt.y );
+    screen.resetClip();
+  }
 }
 
 void Label::align( int a )
@@ -289,7 +293,8 @@ void IconButton::draw( Canvas& screen, const Rect& area )
     if (m_focussed) {
       screen.drawRect(m_pos,screen.makeColour(SELECTED_BG),true);
     }
-    Vec2 textsize = m_font->metrics(m_text);    
+    Canvas* text = TextCache::instance().get( m_font, m_text, m_fg );
+    Vec2 textsize = text ? Vec2(text->width(),text->height()) : Vec2(0,0);
     if (m_vertical) {
       int x = m_pos.centroid().x - m_icon->width()/2; 
       int y = m_pos.centroid().y - m_icon->height()/2 - textsize.y/2; 
@@ -297,14 +302,18 @@ void IconButton::draw( Canvas& screen, const Rect& area )
       screen.drawImage(m_icon,x,y);
       x = m_pos.centroid().x;
       y += m_icon->height() + m_pos.height()/10;
-      m_font->drawCenter( &screen, Vec2(x,y), m_text, m_fg);
+      if (text) {
+	screen.drawImage(text,x-textsize.x/2,y-textsize.y/2);
+      }
     } else {
       int x = m_pos.tl.x + 10;
       int y = m_pos.centroid().y - m_icon->height()/2;
       screen.drawImage(m_icon,x,y);
       x += m_icon->width() + 10;
       y = m_pos.centroid().y - textsize.y/2;
-      m_font->drawLeft( &screen, Vec2(x,y), m_text, m_fg);
+      if (text) {
+	screen.drawImage(text,x,y);
+      }
     }
   } else {
     Button::draw(screen,area);
@@ -318,52 +327,66 @@ void IconButton::draw( Canvas& screen, const Rect& area )
 
 RichText::RichText(const std::string& s, const Font* f)
   : Label(s,f),
-    m_layoutRequired(true)
+    m_layoutRequired(true),
+    m_layoutWidth(0),
+    m_layoutHeight(0)
 {}
 
 RichText::RichText(unsigned char *s, size_t len, const Font* f)
   : Label(std::string((const char*)s, len),f),
-    m_layoutRequired(true)
+    m_layoutRequired(true),
+    m_layoutWidth(0),
+    m_layoutHeight(0)
 {}
 
 void RichText::text( const std::string& s )
 {
   Label::text(s);
   m_layoutRequired = true;
+  m_wordWidths.clear();
 }
 
 void RichText::draw( Canvas& screen, const Rect& area )
 {
   Widget::draw(screen,area);
-  if (m_layoutRequired) {
-    layout(m_pos.width()-20);
-    m_layoutRequired = false;
-  }
+  layout(m_pos.width()-20);
   screen.setClip(area.tl.x,area.tl.y,area.width(),area.height());
   for (size_t l=0; l<m_snippets.size(); l++) {
     if (m_snippets[l].textlen > 0) {
       Vec2 pos = m_pos.tl + m_snippets[l].pos;
+      if (pos.y >= area.br.y) {
+	break; // the rest are further down
+      }
       Vec2 posnext = l==m_snippets.size()-1 ? pos:m_pos.tl+m_snippets[l+1].pos;
-      if (pos.y < area.br.y && posnext.y >= area.tl.y ) {
-	std::string sniptext = m_text.substr(m_snippets[l].textoff,
-					     m_snippets[l].textlen);
-	switch (m_snippets[l].align) {
-	case 1:
-	  pos.x += (m_pos.width()-20-m_snippets[l].font->metrics(sniptext).x)/2;
-	  break;
-	case 2:
-	  pos.x += m_pos.width()-20-m_snippets[l].font->metrics(sniptext).x;
-	  break;
-	}
-	m_snippets[l].font->drawLeft( &screen, pos, sniptext, m_fg);
+      if (posnext.y >= area.tl.y ) {
+	m_snippets[l].font->drawLeft( &screen, pos, m_snippets[l].text, m_fg);
       }
     }
   }
   screen.resetClip();
 }
 
+int RichText::wordWidth(const Font* font, size_t p, size_t e)
+{
+  std::pair<const Font*,size_t> key(font,p);
+  std::map<std::pair<const Font*,size_t>,int>::iterator i = m_wordWidths.find(key);
+  if (i != m_wordWidths.end()) {
+    return i->second;
+  }
+  size_t len = e==std::string::npos ? m_text.length()-p : e-p;
+  int width = font->metrics(m_text.data()+p, len).x;
+  m_wordWidths[key] = width;
+  return width;
+}
+
 int RichText::layout(int w)
 {
+  if (!m_layoutRequired && w == m_layoutWidth) {
+    return m_layoutHeight;
+  }
+  m_layoutRequired = false;
+  m_layoutWidth = w;
+
   struct Tag {
     Tag(const std::string& str, size_t begin, size_t end)
       : m_str(str), m_closed(false), m_begin(begin), m_end(end)
@@ -402,7 +425,7 @@ int RichText::layout(int w)
   int x = margin, y = 0, l = 0, h = 0;
   size_t p=0;
   int spacewidth = m_font->metrics(" ").x;
-  Snippet snippet = {Vec2(x,y),0,0,0,m_font};
+  Snippet snippet = {Vec2(x,y),0,0,0,m_font,""};
   Vec2 wordmetrics;
   m_snippets.clear();
   m_snippets.push_back(snippet);
@@ -411,11 +434,7 @@ int RichText::layout(int w)
     bool newline = false;
     size_t e = m_text.find_first_of(" \t\n\r<>", p); 
 
-    if (e==std::string::npos) {
-      wordmetrics = snippet.font->metrics(m_text.substr(p,e));
-    } else {
-      wordmetrics = snippet.font->metrics(m_text.substr(p,e-p));
-    }
+    wordmetrics.x = wordWidth(snippet.font, p, e);
     if (x!=margin) {
       // space
       wordmetrics.x += spacewidth;
@@ -504,6 +523,24 @@ int RichText::layout(int w)
     }
     
   }
+
+  // extract and align the text once here rather than on every draw
+  for (size_t i=0; i<m_snippets.size(); i++) {
+    Snippet& s = m_snippets[i];
+    if (s.textlen <= 0) {
+      continue;
+    }
+    s.text = m_text.substr(s.textoff, s.textlen);
+    switch (s.align) {
+    case 1:
+      s.pos.x += (m_layoutWidth-s.font->metrics(s.text).x)/2;
+      break;
+    case 2:
+      s.pos.x += m_layoutWidth-s.font->metrics(s.text).x;
+      break;
+    }
+  }
+  m_layoutHeight = y;
   return y;
 }
 
@@ -617,6 +654,11 @@ void Draggable::onTick( int tick )
   }
 }
 
+bool Draggable::isIdle()
+{
+  return !m_dragging && m_delta.x == 0 && m_delta.y == 0 && Panel::isIdle();
+}
+
 
 ////////////////////////////////////////////////////////////////
 
@@ -676,6 +718,123 @@ void ScrollArea::empty()
 
 
 
+////////////////////////////////////////////////////////////////
+
+
+GridView::GridView( const Vec2& cellSize, const Vec2& spacing )
+  : m_cellSize(cellSize),
+    m_spacing(spacing),
+    m_viewport(NULL),
+    m_layoutWidth(-1)
+{}
+
+GridView::~GridView()
+{
+  for (size_t i=0; i<m_free.size(); ++i) {
+    delete m_free[i];
+  }
+}
+
+int GridView::columns()
+{
+  int cols = (m_pos.width() + m_spacing.x) / (m_cellSize.x + m_spacing.x);
+  return cols > 0 ? cols : 1;
+}
+
+int GridView::contentHeight()
+{
+  int rows = (count() + columns() - 1) / columns();
+  return rows * (m_cellSize.y + m_spacing.y);
+}
+
+void GridView::move( const Vec2& by )
+{
+  Panel::move(by);
+  refresh();
+}
+
+void GridView::onResize()
+{
+  if (m_pos.width() != m_layoutWidth) {
+    // columns and margins may have changed, so rebind from scratch
+    m_layoutWidth = m_pos.width();
+    reload();
+  }
+}
+
+void GridView::draw( Canvas& screen, const Rect& area )
+{
+  refresh();
+  Panel::draw(screen,area);
+}
+
+void GridView::reload()
+{
+  while (m_cells.size() > 0) {
+    recycle(m_cells.begin()->first);
+  }
+  refresh();
+}
+
+void GridView::recycle( int item )
+{
+  Widget* cell = m_cells[item];
+  m_cells.erase(item);
+  int index = indexOf(m_children, cell);
+  if (index >= 0) {
+    m_children.erase(m_children.begin() + index);
+  }
+  cell->setParent(NULL);
+  m_free.push_back(cell);
+}
+
+void GridView::refresh()
+{
+  int cols = columns();
+  int rowh = m_cellSize.y + m_spacing.y;
+  Rect view = m_viewport ? m_viewport->position() : FULLSCREEN_RECT;
+
+  // one row of slack either side so cells are ready before they show
+  int first = ((view.tl.y - m_pos.tl.y) / rowh - 1) * cols;
+  int last = ((view.br.y - m_pos.tl.y) / rowh + 2) * cols;
+  first = first > 0 ? first : 0;
+  last = last < count() ? last : count();
+
+  std::vector<int> gone;
+  for (std::map<int,Widget*>::iterator i=m_cells.begin(); i!=m_cells.end(); ++i) {
+    if (i->first < first || i->first >= last) {
+      gone.push_back(i->first);
+    }
+  }
+  for (size_t i=0; i<gone.size(); ++i) {
+    recycle(gone[i]);
+  }
+
+  int left = (m_pos.width() - cols*(m_cellSize.x+m_spacing.x) + m_spacing.x) / 2;
+  for (int i=first; i<last; i++) {
+    if (m_cells.find(i) != m_cells.end()) {
+      continue;
+    }
+    Widget* cell;
+    if (m_free.size() > 0) {
+      cell = m_free.back();
+      m_free.pop_back();
+    } else {
+      cell = createCell();
+    }
+    m_cells[i] = cell;
+    // not Container::add, which would resize us and so reload
+    cell->setParent(this);
+    cell->sizeTo(m_cellSize);
+    cell->moveTo(m_pos.tl + Vec2(left + (i%cols)*(m_cellSize.x+m_spacing.x),
+				 (i/cols)*rowh));
+    m_children.push_back(cell);
+    bindCell(cell, i);
+    dirty();
+  }
+}
+
+
 ////////////////////////////////////////////////////////////////
 
 
@@ -740,6 +899,16 @@ void Container::onTick( int tick )
   }
 }
 
+bool Container::isIdle()
+{
+  for (size_t i=0; i<m_children.size(); ++i) {
+    if (!m_children[i]->isIdle()) {
+      return false;
+    }
+  }
+  return true;
+}
+
 void Container::draw( Canvas& screen, const Rect& area )
 {
   WidgetParent::draw(screen,area);
@@ -1040,6 +1209,11 @@ void Dialog::onTick( int tick )
   Panel::onTick(tick);
 }
 
+bool Dialog::isIdle()
+{
+  return !m_closeRequested && m_pos.tl == m_targetPos && Panel::isIdle();
+}
+
 bool Dialog::processEvent( SDL_Event& ev )
 {
   if (ev.type == SDL_MOUSEBUTTONUP
@@ -23,6 +23,7 @@
 
 #include <string>
 #include <vector>
+#include <map>
 
 class Canvas;
 class Widget;
@@ -51,6 +52,8 @@ class Widget
   virtual bool isDirty() {return m_dirty;}
   virtual Rect dirtyArea() {return m_dirty?m_pos:Rect();};
   virtual void onTick( int tick ) {}
+  /// @return true if ticking would not change anything until new input
+  virtual bool isIdle() { return true; }
   virtual void draw( Canvas& screen, const Rect& area );
   virtual bool processEvent( SDL_Event& ev );
   
@@ -171,17 +174,26 @@ class RichText : public Label
   RichText(unsigned char *s, size_t len, const Font* f=NULL);
   virtual void text( const std::string& s );
   virtual void draw( Canvas& screen, const Rect& area );
+  /// lay out for width w, reusing the last layout if neither the text
+  /// nor the width has changed
+  /// @return height of the laid out text
   int layout(int w);
  protected:
   struct Snippet {
-    Vec2 pos;
+    Vec2 pos;      // alignment already applied
     size_t textoff;
     int textlen;
     int align;
     const Font* font;
+    std::string text;
   };
+  int wordWidth(const Font* font, size_t p, size_t e);
   std::vector<Snippet> m_snippets;
   bool m_layoutRequired;
+  int m_layoutWidth;
+  int m_layoutHeight;
+  /// word widths by font and offset, kept until the text changes
+  std::map<std::pair<const Font*,size_t>,int> m_wordWidths;
 };
 
 class WidgetParent : public Widget
@@ -207,6 +219,7 @@ class Container : public WidgetParent
   virtual bool isDirty();
   virtual Rect dirtyArea();
   virtual void onTick( int tick );
+  virtual bool isIdle();
   virtual void draw( Canvas& screen, const Rect& area );
   virtual bool processEvent( SDL_Event& ev );
   virtual void onResize();
@@ -262,6 +275,7 @@ class Draggable : public Panel
   bool onPreEvent( Event& ev );
   bool onEvent( Event& ev );
   void onTick( int tick );
+  bool isIdle();
   void step( const Vec2& s ) { m_step = s; }
  protected:
   bool m_dragMaybe;
@@ -290,6 +304,49 @@ class ScrollArea : public Panel
   Draggable* m_contents;
 };
 
+/**
+ * @brief Grid of equally sized cells of which only those in or near the
+ * viewport exist
+ *
+ * Cells are made by createCell() and pointed at an item by bindCell().
+ * As the grid scrolls, cells leaving the viewport are recycled for
+ * those coming into it, so memory does not grow with count().
+ */
+class GridView : public Panel
+{
+ public:
+  GridView( const Vec2& cellSize, const Vec2& spacing=Vec2(10,10) );
+  ~GridView();
+  const char* name() {return "GridView";}
+  virtual void move( const Vec2& by );
+  virtual void onResize();
+  virtual void draw( Canvas& screen, const Rect& area );
+
+  /// widget whose position bounds what is visible, the screen if NULL
+  void viewport( Widget* w ) { m_viewport = w; }
+  /// @return height needed to show all count() items at the current width
+  int contentHeight();
+  /// forget every binding, eg after the items changed
+  void reload();
+
+ protected:
+  virtual int count() =0;
+  virtual Widget* createCell() =0;
+  virtual void bindCell( Widget* cell, int item ) =0;
+
+ private:
+  int columns();
+  void refresh();
+  void recycle( int item );
+
+  Vec2 m_cellSize;
+  Vec2 m_spacing;
+  Widget* m_viewport;
+  int m_layoutWidth;
+  std::map<int,Widget*> m_cells;   // bound cells by item
+  std::vector<Widget*> m_free;     // detached, ready for reuse
+};
+
 struct MenuItem
 {
   MenuItem(const std::string& s, Event ev=Event::NOP)
@@ -334,6 +391,7 @@ class Dialog : public Panel
   Dialog( const std::string &title="", Event left=Event::NOP, Event right=Event::NOP );
   const char* name() {return "Dialog";}
   void onTick( int tick );
+  bool isIdle();
   bool processEvent( SDL_Event& ev );
   bool onEvent( Event& ev );
   bool close();
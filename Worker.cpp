@@ -17,52 +17,328 @@
 #include "Worker.h"
 #include "Event.h"
 #include <stdio.h>
+#include <assert.h>
 
-WorkerBase::WorkerBase( int (*func)(void*) ) 
-  : m_func(func),
-    m_thread(NULL)
+
+Task::Task( int priority )
+  : m_priority(priority),
+    m_notify(false),
+    m_state(IDLE),
+    m_cancelRequested(false),
+    m_pool(NULL),
+    m_mutex(SDL_CreateMutex()),
+    m_cond(SDL_CreateCond())
 {
 }
 
-WorkerBase::~WorkerBase()
+Task::~Task()
+{
+  // too late to wait here: a running derived run() would already have
+  // lost its members, so the derived class must have waited
+  assert(done());
+  SDL_DestroyCond(m_cond);
+  SDL_DestroyMutex(m_mutex);
+}
+
+void Task::setState( State s )
 {
-  if (m_thread) {
-    //TODO need cleaner termination/forget - worker may leak resources
-    //SDL_KillThread(m_thread);
+  // a waiter may delete us as soon as the state changes so take
+  // everything needed for the notification first
+  bool notify = m_notify && (s == FINISHED || s == CANCELLED);
+  void *self = this;
+
+  SDL_LockMutex(m_mutex);
+  m_state = s;
+  SDL_CondBroadcast(m_cond);
+  SDL_UnlockMutex(m_mutex);
+
+  if (notify) {
+    SDL_Event event;
+    event.type = SDL_USEREVENT;
+    event.user.code = WORKER_DONE;
+    event.user.data1 = self;
+    event.user.data2 = 0;
+    SDL_PushEvent(&event);
   }
 }
 
-void WorkerBase::start(const char* thread_name)
+bool Task::done()
 {
-  if (m_func) {
-    m_thread = SDL_CreateThread(m_func, thread_name, this);
+  SDL_LockMutex(m_mutex);
+  bool d = m_state != QUEUED && m_state != RUNNING;
+  SDL_UnlockMutex(m_mutex);
+  return d;
+}
+
+void Task::wait()
+{
+  SDL_LockMutex(m_mutex);
+  while (m_state == QUEUED || m_state == RUNNING) {
+    SDL_CondWait(m_cond, m_mutex);
+  }
+  SDL_UnlockMutex(m_mutex);
+}
+
+bool Task::cancel()
+{
+  SDL_LockMutex(m_mutex);
+  m_cancelRequested = true;
+  bool queued = (m_state == QUEUED);
+  SDL_UnlockMutex(m_mutex);
+
+  if (queued && m_pool && m_pool->withdraw(this)) {
+    setState(CANCELLED);
+    return true;
+  }
+  return false;
+}
+
+bool Task::cancelRequested()
+{
+  SDL_LockMutex(m_mutex);
+  bool c = m_cancelRequested;
+  SDL_UnlockMutex(m_mutex);
+  return c;
+}
+
+bool Task::cancelled()
+{
+  SDL_LockMutex(m_mutex);
+  bool c = (m_state == CANCELLED);
+  SDL_UnlockMutex(m_mutex);
+  return c;
+}
+
+
+
+ThreadPool::ThreadPool( int threads )
+  : m_idleLock(SDL_CreateMutex()),
+    m_idleCond(SDL_CreateCond()),
+    m_pending(0),
+    m_next(0),
+    m_stopping(false)
+{
+  if (threads <= 0) {
+    threads = SDL_GetCPUCount();
+  }
+  if (threads < 1) {
+    threads = 1;
+  }
+  for (int i=0; i<threads; i++) {
+    Queue *q = new Queue;
+    q->lock = SDL_CreateMutex();
+    m_queues.push_back(q);
+  }
+  // ids are filled in by the workers themselves
+  m_threadIds.resize(threads, 0);
+  for (int i=0; i<threads; i++) {
+    char name[32];
+    sprintf(name, "pool%d", i);
+    m_threads.push_back(SDL_CreateThread(threadMain, name, this));
+  }
+}
+
+ThreadPool::~ThreadPool()
+{
+  // nothing new will start, anything queued is abandoned
+  for (size_t i=0; i<m_queues.size(); i++) {
+    SDL_LockMutex(m_queues[i]->lock);
+    std::deque<Task*> orphans;
+    orphans.swap(m_queues[i]->tasks);
+    SDL_UnlockMutex(m_queues[i]->lock);
+    for (size_t j=0; j<orphans.size(); j++) {
+      orphans[j]->setState(Task::CANCELLED);
+    }
+  }
+
+  SDL_LockMutex(m_idleLock);
+  m_stopping = true;
+  SDL_CondBroadcast(m_idleCond);
+  SDL_UnlockMutex(m_idleLock);
+
+  for (size_t i=0; i<m_threads.size(); i++) {
+    SDL_WaitThread(m_threads[i], NULL);
+  }
+  for (size_t i=0; i<m_queues.size(); i++) {
+    SDL_DestroyMutex(m_queues[i]->lock);
+    delete m_queues[i];
+  }
+  SDL_DestroyCond(m_idleCond);
+  SDL_DestroyMutex(m_idleLock);
+}
+
+ThreadPool& ThreadPool::get()
+{
+  static ThreadPool pool;
+  return pool;
+}
+
+int ThreadPool::currentWorker()
+{
+  SDL_threadID self = SDL_ThreadID();
+  for (size_t i=0; i<m_threadIds.size(); i++) {
+    if (m_threadIds[i] == self) {
+      return (int)i;
+    }
+  }
+  return -1;
+}
+
+void ThreadPool::submit( Task* task )
+{
+  SDL_LockMutex(task->m_mutex);
+  task->m_pool = this;
+  task->m_state = Task::QUEUED;
+  task->m_cancelRequested = false;
+  SDL_UnlockMutex(task->m_mutex);
+
+  SDL_LockMutex(m_idleLock);
+  int index = currentWorker();
+  if (index < 0) {
+    index = m_next;
+    m_next = (m_next + 1) % size();
+  }
+  SDL_UnlockMutex(m_idleLock);
+
+  // keep each deque ordered highest priority first, fifo within a priority
+  Queue *q = m_queues[index];
+  SDL_LockMutex(q->lock);
+  std::deque<Task*>::iterator it = q->tasks.begin();
+  while (it != q->tasks.end() && (*it)->priority() >= task->priority()) {
+    ++it;
+  }
+  q->tasks.insert(it, task);
+  SDL_UnlockMutex(q->lock);
+
+  SDL_LockMutex(m_idleLock);
+  m_pending++;
+  SDL_CondSignal(m_idleCond);
+  SDL_UnlockMutex(m_idleLock);
+}
+
+Task* ThreadPool::take( int index )
+{
+  Task *task = NULL;
+  Queue *own = m_queues[index];
+  SDL_LockMutex(own->lock);
+  if (own->tasks.size()) {
+    task = own->tasks.front();
+    own->tasks.pop_front();
+  }
+  SDL_UnlockMutex(own->lock);
+
+  // steal the most urgent task from a sibling
+  for (int pass=Task::HIGH; !task && pass>=Task::LOW; pass--) {
+    for (int i=1; i<size() && !task; i++) {
+      Queue *victim = m_queues[(index+i) % size()];
+      SDL_LockMutex(victim->lock);
+      if (victim->tasks.size() && victim->tasks.front()->priority() >= pass) {
+	task = victim->tasks.front();
+	victim->tasks.pop_front();
+      }
+      SDL_UnlockMutex(victim->lock);
+    }
+  }
+
+  if (task) {
+    SDL_LockMutex(m_idleLock);
+    m_pending--;
+    SDL_UnlockMutex(m_idleLock);
+  }
+  return task;
+}
+
+bool ThreadPool::withdraw( Task* task )
+{
+  for (size_t i=0; i<m_queues.size(); i++) {
+    Queue *q = m_queues[i];
+    SDL_LockMutex(q->lock);
+    for (std::deque<Task*>::iterator it = q->tasks.begin();
+	 it != q->tasks.end(); ++it) {
+      if (*it == task) {
+	q->tasks.erase(it);
+	SDL_UnlockMutex(q->lock);
+	SDL_LockMutex(m_idleLock);
+	m_pending--;
+	SDL_UnlockMutex(m_idleLock);
+	return true;
+      }
+    }
+    SDL_UnlockMutex(q->lock);
+  }
+  return false;
+}
+
+int ThreadPool::threadMain( void* arg )
+{
+  ThreadPool *pool = (ThreadPool*)arg;
+  SDL_threadID self = SDL_ThreadID();
+  int index = -1;
+  SDL_LockMutex(pool->m_idleLock);
+  for (size_t i=0; i<pool->m_threadIds.size() && index<0; i++) {
+    if (pool->m_threadIds[i] == 0) {
+      pool->m_threadIds[i] = self;
+      index = (int)i;
+    }
+  }
+  SDL_UnlockMutex(pool->m_idleLock);
+  pool->workerLoop(index);
+  return 0;
+}
+
+void ThreadPool::workerLoop( int index )
+{
+  for (;;) {
+    Task *task = take(index);
+    if (task) {
+      task->setState(Task::RUNNING);
+      try {
+	task->run();
+      } catch (...) {
+	// still finish, or the task's waiters would block for ever
+	fprintf(stderr,"ThreadPool: task threw an exception\n");
+      }
+      task->setState(Task::FINISHED);
+      continue;
+    }
+    SDL_LockMutex(m_idleLock);
+    while (!m_stopping && m_pending == 0) {
+      SDL_CondWait(m_idleCond, m_idleLock);
+    }
+    bool stop = m_stopping;
+    SDL_UnlockMutex(m_idleLock);
+    if (stop) {
+      return;
+    }
   }
 }
 
 
-void WorkerBase::wait()
+
+WorkerBase::WorkerBase( int (*func)(void*) ) 
+  : m_func(func)
+{
+  notify(true);
+}
+
+WorkerBase::~WorkerBase()
 {
-  if (m_thread) {
-    SDL_WaitThread(m_thread,NULL);
+}
+
+void WorkerBase::start(const char* thread_name)
+{
+  if (m_func) {
+    ThreadPool::get().submit(this);
   }
 }
 
-bool WorkerBase::done()
+void WorkerBase::run()
 {
-  return m_thread == NULL;
+  m_func(this);
 }
 
 int WorkerBase::startThread(void* wbase)
 {
   ((WorkerBase*)wbase)->main();
-  ((WorkerBase*)wbase)->m_thread = NULL;
-
-  // Create a user event to signal completion
-  SDL_Event event;
-  event.type = SDL_USEREVENT;
-  event.user.code = WORKER_DONE;
-  event.user.data1 = wbase;
-  event.user.data2 = 0;
-  SDL_PushEvent(&event);
   return 0;
 }
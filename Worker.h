@@ -19,21 +19,141 @@
 
 #include <SDL.h>
 #include <SDL_thread.h>
+#include <deque>
+#include <vector>
 
-class WorkerBase
+class ThreadPool;
+
+/**
+ * @brief Unit of work for a ThreadPool, doubling as its own future
+ *
+ * The submitter keeps ownership: a task must not be deleted while it is
+ * queued or running. Wait for it before deleting it, or have the most
+ * derived destructor cancel() and wait(), since by the time ~Task runs
+ * the derived members are gone. An exception escaping run() is caught
+ * by the pool and the task still finishes.
+ */
+class Task
+{
+ public:
+  enum Priority { LOW, NORMAL, HIGH };
+
+  Task( int priority=NORMAL );
+  virtual ~Task();
+  virtual void run() =0;
+
+  int priority() const { return m_priority; }
+  /// post an SDL_USEREVENT WORKER_DONE with data1=this when finished
+  void notify( bool n ) { m_notify = n; }
+
+  /// @return true once run() has returned or the task was cancelled
+  bool done();
+  /// block until done()
+  void wait();
+  /// Withdraw the task if it has not started yet, otherwise ask run() to
+  /// stop at its next cancelRequested() check.
+  /// @return true if the task was withdrawn and run() will never be called
+  bool cancel();
+  bool cancelRequested();
+  bool cancelled();
+
+ private:
+  friend class ThreadPool;
+  enum State { IDLE, QUEUED, RUNNING, FINISHED, CANCELLED };
+  void setState( State s );
+
+  int         m_priority;
+  bool        m_notify;
+  State       m_state;
+  bool        m_cancelRequested;
+  ThreadPool *m_pool;
+  SDL_mutex  *m_mutex;
+  SDL_cond   *m_cond;
+};
+
+
+/**
+ * @brief Task returning a value
+ */
+template< typename R >
+class Future : public Task
+{
+ public:
+  Future( int priority=NORMAL ) : Task(priority), m_result() {}
+  /// wait for and @return the result, default constructed if cancelled
+  R result() { wait(); return m_result; }
+ protected:
+  virtual R compute() =0;
+  virtual void run() { m_result = compute(); }
+ private:
+  R m_result;
+};
+
+
+/**
+ * @brief Fixed set of worker threads with one task deque each
+ *
+ * Workers take the highest priority task from their own deque and,
+ * when that is empty, steal from the busiest sibling. Tasks submitted
+ * from a worker stay on that worker's deque.
+ */
+class ThreadPool
+{
+ public:
+  /// @param threads number of workers, 0 for one per cpu
+  ThreadPool( int threads=0 );
+  /// cancels everything still queued and joins the workers
+  ~ThreadPool();
+
+  /// shared pool for the whole application
+  static ThreadPool& get();
+
+  void submit( Task* task );
+  int size() const { return (int)m_queues.size(); }
+
+ private:
+  friend class Task;
+  struct Queue {
+    SDL_mutex *lock;
+    std::deque<Task*> tasks;
+  };
+
+  static int threadMain( void* arg );
+  void workerLoop( int index );
+  Task* take( int index );
+  bool withdraw( Task* task );
+  int currentWorker();
+
+  std::vector<Queue*>       m_queues;
+  std::vector<SDL_Thread*>  m_threads;
+  std::vector<SDL_threadID> m_threadIds;
+  SDL_mutex *m_idleLock;
+  SDL_cond  *m_idleCond;
+  int        m_pending;
+  int        m_next;
+  bool       m_stopping;
+};
+
+
+/**
+ * @brief Adapter running a main() on the shared ThreadPool
+ *
+ * Completion is still announced with an SDL_USEREVENT WORKER_DONE.
+ */
+class WorkerBase : public Task
 {
  public:
   WorkerBase( int (*func)(void*)=startThread );  
   virtual ~WorkerBase();
   void start(const char* thread_name);
   virtual void main() =0;
-  void wait();
-  bool done();
+
+ protected:
+  virtual void run();
 
  private:
   static int  startThread(void* wbase);
   int        (*m_func)(void*);
-  SDL_Thread  *m_thread;
 };
 
 typedef WorkerBase Worker;
@@ -47,6 +167,12 @@ class WorkerF : public WorkerBase
   WorkerF( F ff, A aa, B bb, C cc )
     : f(ff), a(aa), b(bb), c(cc)
     {}
+  ~WorkerF()
+  {
+    // main() uses our members, so the pool must be finished with us
+    cancel();
+    wait();
+  }
   
   virtual void main() 
   {
@@ -35,6 +35,11 @@
 	#include <netdb.h>	// for gethostbyname()
 	#include <errno.h>
 	#include <unistd.h>
+	// a pipelined send can race the server closing a kept-alive
+	// connection; report EPIPE rather than dying of SIGPIPE
+	#ifndef MSG_NOSIGNAL
+		#define MSG_NOSIGNAL 0
+	#endif
 #endif
 
 #ifdef WIN32
@@ -415,7 +420,7 @@ void Connection::send( const unsigned char* buf, int numbytes )
 #ifdef WIN32
 		int n = ::send( m_Sock, (const char*)buf, numbytes, 0 );
 #else
-		int n = ::send( m_Sock, buf, numbytes, 0 );
+		int n = ::send( m_Sock, buf, numbytes, MSG_NOSIGNAL );
 #endif
 		if( n<0 )
 			BailOnSocketError( "send()" );
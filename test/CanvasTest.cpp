@@ -0,0 +1,453 @@
+#include "Canvas.h"
+#include "Config.h"
+#include "Path.h"
+#include <SDL_image.h>
+#include <cstring>
+#include <unistd.h>
+#include <gtest/gtest.h>
+#include "TestCommon.h"
+
+
+// odd sizes so the vector kernels leave a scalar tail
+static const int W = 37;
+static const int H = 11;
+
+static void fillPattern(Canvas& c)
+{
+    for (int y = 0; y < c.height(); y++) {
+	for (int x = 0; x < c.width(); x++) {
+	    c.drawPixel(x, y, c.makeColour((x*37 + y*101) & 0xff,
+					   (x*13) & 0xff, (y*29) & 0xff));
+	}
+    }
+}
+
+
+TEST(Canvas, fade_halves_inclusive_rect)
+{
+    Canvas c(W, H);
+    fillPattern(c);
+    Canvas orig(W, H);
+    fillPattern(orig);
+
+    Rect r(3, 2, W-5, H-3);
+    c.fade(r);
+
+    for (int y = 0; y < H; y++) {
+	for (int x = 0; x < W; x++) {
+	    int p = orig.readPixel(x, y);
+	    if (r.contains(Vec2(x, y))) {
+		ASSERT_EQ(orig.fadeColour(p), c.readPixel(x, y)) << x << "," << y;
+	    } else {
+		ASSERT_EQ(p, c.readPixel(x, y)) << x << "," << y;
+	    }
+	}
+    }
+}
+
+TEST(Canvas, fade_clips)
+{
+    Canvas c(W, H);
+    fillPattern(c);
+    c.fade(Rect(-10, -10, W+10, H+10));
+    c.fade(Rect(W+1, H+1, W+20, H+20));
+}
+
+TEST(Canvas, clearFaded_matches_clear_then_fade)
+{
+    Canvas bg(W, H);
+    fillPattern(bg);
+
+    Canvas expected(W, H);
+    expected.setBackground(&bg);
+    expected.clear();
+    Rect r(1, 1, W-2, H-2);
+    expected.fade(r);
+
+    Canvas c(W, H);
+    c.setBackground(&bg);
+    c.clear();
+    c.clearFaded(r);
+    // again, from the cached faded background
+    c.clearFaded(r);
+
+    for (int y = 0; y < H; y++) {
+	for (int x = 0; x < W; x++) {
+	    ASSERT_EQ(expected.readPixel(x, y) & 0xffffff,
+		      c.readPixel(x, y) & 0xffffff) << x << "," << y;
+	}
+    }
+}
+
+TEST(Canvas, clearFaded_colour)
+{
+    Canvas c(W, H);
+    int colour = c.makeColour(0xc08040);
+    c.setBackground(colour);
+    c.clearFaded(Rect(0, 0, W-1, H-1));
+    ASSERT_EQ(c.fadeColour(colour), c.readPixel(W/2, H/2));
+}
+
+
+static int nextRandom(unsigned& seed)
+{
+    seed = seed*1103515245 + 12345;
+    return (seed >> 16) & 0x7fff;
+}
+
+// many short segments in every direction, like a busy level
+static std::vector<Path> denseStrokes(int w, int h)
+{
+    std::vector<Path> strokes;
+    unsigned seed = 12345;
+    for (int s = 0; s < 200; s++) {
+	Path p;
+	int x = 10 + nextRandom(seed) % (w-20);
+	int y = 10 + nextRandom(seed) % (h-20);
+	for (int i = 0; i < 40; i++) {
+	    p.append(Vec2(x, y));
+	    x = std::max(0, std::min(w-1, x + nextRandom(seed) % 61 - 30));
+	    y = std::max(0, std::min(h-1, y + nextRandom(seed) % 61 - 30));
+	}
+	strokes.push_back(p);
+    }
+    return strokes;
+}
+
+static void drawStrokes(Canvas& c, const std::vector<Path>& strokes,
+			bool thick)
+{
+    for (size_t i = 0; i < strokes.size(); i++) {
+	c.drawPath(strokes[i], c.makeColour(brushColours[i%NUM_BRUSHES]), thick);
+    }
+}
+
+TEST(Canvas, span_lines_match_per_pixel)
+{
+    std::vector<Path> strokes = denseStrokes(400, 300);
+    for (int thick = 0; thick < 2; thick++) {
+	Canvas ref(400, 300);
+	Canvas span(400, 300);
+	fillPattern(ref);
+	fillPattern(span);
+
+	SPAN_LINES = false;
+	drawStrokes(ref, strokes, thick);
+	SPAN_LINES = true;
+	drawStrokes(span, strokes, thick);
+
+	for (int y = 0; y < 300; y++) {
+	    for (int x = 0; x < 400; x++) {
+		ASSERT_EQ(ref.readPixel(x, y), span.readPixel(x, y))
+		    << x << "," << y << " thick=" << thick;
+	    }
+	}
+    }
+}
+
+TEST(Canvas, clipped_redraw_matches_full_draw)
+{
+    std::vector<Path> strokes = denseStrokes(400, 300);
+    // some strokes running off the canvas too
+    Path offscreen;
+    offscreen.append(Vec2(-50, 20));
+    offscreen.append(Vec2(450, 280));
+    offscreen.append(Vec2(200, -40));
+    strokes.push_back(offscreen);
+
+    for (int thick = 0; thick < 2; thick++) {
+	Canvas full(400, 300);
+	fillPattern(full);
+	drawStrokes(full, strokes, thick);
+
+	Rect clips[] = { Rect(0, 0, 399, 299), Rect(37, 41, 95, 77),
+			 Rect(200, 10, 201, 290), Rect(390, 290, 399, 299) };
+	for (size_t k = 0; k < sizeof(clips)/sizeof(clips[0]); k++) {
+	    const Rect& r = clips[k];
+	    Canvas part(400, 300);
+	    fillPattern(part);
+	    Canvas orig(400, 300);
+	    fillPattern(orig);
+	    part.setClip(r.tl.x, r.tl.y, r.width(), r.height());
+	    drawStrokes(part, strokes, thick);
+
+	    for (int y = 0; y < 300; y++) {
+		for (int x = 0; x < 400; x++) {
+		    int expected = r.contains(Vec2(x, y)) ? full.readPixel(x, y)
+							  : orig.readPixel(x, y);
+		    ASSERT_EQ(expected, part.readPixel(x, y))
+			<< x << "," << y << " clip " << k << " thick=" << thick;
+		}
+	    }
+	}
+    }
+}
+
+static Path spritePath(int len)
+{
+    Path p;
+    p.append(Vec2(0, 0));
+    p.append(Vec2(len, len/2));
+    p.append(Vec2(len/2, len));
+    return p;
+}
+
+TEST(SpriteCache, hits_after_add)
+{
+    SpriteCache cache;
+    Canvas c(100, 100);
+    int owner;
+    SpriteCache::Key key = { &owner, 3, 0xff0000, false };
+
+    ASSERT_FALSE(cache.draw(c, key, Vec2(50, 50)));
+    cache.add(key, spritePath(20));
+    ASSERT_TRUE(cache.draw(c, key, Vec2(50, 50)));
+    ASSERT_EQ(1, cache.hits());
+    ASSERT_EQ(1, cache.misses());
+    ASSERT_EQ(1, cache.added());
+
+    // the sprite lands where the path would have been drawn
+    Canvas direct(100, 100);
+    Path p = spritePath(20);
+    p.translate(Vec2(50, 50));
+    direct.drawPath(p, direct.makeColour(0xff0000), false);
+    for (int y = 0; y < 100; y++) {
+	for (int x = 0; x < 100; x++) {
+	    int want = direct.readPixel(x, y) & 0xffffff;
+	    int got = c.readPixel(x, y) & 0xffffff;
+	    // blending coverage as alpha rounds a little differently
+	    ASSERT_NEAR(want >> 16, got >> 16, 2) << x << "," << y;
+	    ASSERT_EQ(0, got & 0xffff) << x << "," << y;
+	}
+    }
+
+    key.angle = 4;
+    ASSERT_FALSE(cache.draw(c, key, Vec2(50, 50)));
+}
+
+TEST(SpriteCache, evicts_least_recent_under_cap)
+{
+    SpriteCache cache;
+    int owner;
+    SpriteCache::Key key = { &owner, 0, 0xffffff, true };
+    cache.add(key, spritePath(40));
+    int oneSprite = cache.bytes();
+    ASSERT_GT(oneSprite, 0);
+
+    cache.maxBytes(oneSprite*2);
+    for (int i = 1; i < 5; i++) {
+	key.angle = i;
+	cache.add(key, spritePath(40));
+	ASSERT_LE(cache.bytes(), cache.maxBytes());
+    }
+    ASSERT_EQ(2, cache.size());
+
+    Canvas c(10, 10);
+    key.angle = 4;
+    ASSERT_TRUE(cache.draw(c, key, Vec2(0, 0)));
+    key.angle = 0;
+    ASSERT_FALSE(cache.draw(c, key, Vec2(0, 0)));
+
+    cache.maxBytes(0);
+    ASSERT_EQ(0, cache.size());
+    cache.add(key, spritePath(40));
+    ASSERT_EQ(0, cache.size());
+}
+
+TEST(SpriteCache, forget_drops_only_that_owner)
+{
+    SpriteCache cache;
+    int a, b;
+    SpriteCache::Key key = { &a, 0, 0xffffff, false };
+    for (int i = 0; i < 3; i++) {
+	key.angle = i;
+	cache.add(key, spritePath(10));
+    }
+    key.owner = &b;
+    cache.add(key, spritePath(10));
+    ASSERT_EQ(4, cache.size());
+
+    cache.forget(&a);
+    ASSERT_EQ(1, cache.size());
+    Canvas c(10, 10);
+    ASSERT_TRUE(cache.draw(c, key, Vec2(0, 0)));
+    cache.forget(&b);
+    ASSERT_EQ(0, cache.size());
+    ASSERT_EQ(0, cache.bytes());
+}
+
+static void paintStrokes(Canvas& c, const std::vector<Path>& strokes,
+			 bool thick, const Rect& area)
+{
+    TiledPainter painter;
+    for (size_t i = 0; i < strokes.size(); i++) {
+	painter.add(strokes[i], c.makeColour(brushColours[i%NUM_BRUSHES]), thick);
+    }
+    painter.paint(c, area);
+}
+
+TEST(TiledPainter, matches_serial_draw)
+{
+    std::vector<Path> strokes = denseStrokes(400, 300);
+    int tileSize = DRAW_TILE_SIZE;
+    // small tiles so most segments cross a tile edge
+    DRAW_TILE_SIZE = 16;
+    Rect areas[] = { Rect(0, 0, 399, 299), Rect(37, 41, 295, 177) };
+    for (size_t k = 0; k < sizeof(areas)/sizeof(areas[0]); k++) {
+	const Rect& r = areas[k];
+	for (int thick = 0; thick < 2; thick++) {
+	    Canvas serial(400, 300);
+	    fillPattern(serial);
+	    serial.setClip(r.tl.x, r.tl.y, r.width(), r.height());
+	    drawStrokes(serial, strokes, thick);
+
+	    Canvas tiled(400, 300);
+	    fillPattern(tiled);
+	    paintStrokes(tiled, strokes, thick, r);
+
+	    for (int y = 0; y < 300; y++) {
+		for (int x = 0; x < 400; x++) {
+		    ASSERT_EQ(serial.readPixel(x, y), tiled.readPixel(x, y))
+			<< x << "," << y << " area " << k << " thick=" << thick;
+		}
+	    }
+	}
+    }
+    DRAW_TILE_SIZE = tileSize;
+}
+
+TEST(Canvas, scaled_keeps_flat_colour)
+{
+    Canvas c(W, H);
+    c.drawRect(0, 0, W, H, c.makeColour(0x4080c0));
+    int sizes[][2] = { {W*3, H*2}, {W/3, H/2}, {W*2, H/3}, {1, 1} };
+    for (size_t i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++) {
+	Canvas* s = c.scaled(sizes[i][0], sizes[i][1]);
+	ASSERT_EQ(sizes[i][0], s->width());
+	ASSERT_EQ(sizes[i][1], s->height());
+	for (int y = 0; y < s->height(); y++) {
+	    for (int x = 0; x < s->width(); x++) {
+		ASSERT_EQ(0x4080c0, s->readPixel(x, y) & 0xffffff) << x << "," << y;
+	    }
+	}
+	delete s;
+    }
+}
+
+TEST(Canvas, scaled_halving_averages_blocks)
+{
+    Canvas c(2*W, 2*H);
+    fillPattern(c);
+    Canvas* s = c.scaled(W, H);
+    for (int y = 0; y < H; y++) {
+	for (int x = 0; x < W; x++) {
+	    int p[4] = { c.readPixel(2*x, 2*y), c.readPixel(2*x+1, 2*y),
+			 c.readPixel(2*x, 2*y+1), c.readPixel(2*x+1, 2*y+1) };
+	    for (int shift = 0; shift < 24; shift += 8) {
+		int sum = 0;
+		for (int k = 0; k < 4; k++) {
+		    sum += (p[k] >> shift) & 0xff;
+		}
+		// rounding in each pass may differ from one overall by one
+		ASSERT_NEAR(sum / 4.0, (s->readPixel(x, y) >> shift) & 0xff, 1.0)
+		    << x << "," << y << " shift " << shift;
+	    }
+	}
+    }
+    delete s;
+}
+
+TEST(Canvas, scaled_enlarging_interpolates)
+{
+    // a left to right ramp stays a ramp
+    Canvas c(16, 4);
+    for (int x = 0; x < 16; x++) {
+	c.drawRect(x, 0, 1, 4, c.makeColour(x*16, 0, 0));
+    }
+    Canvas* s = c.scaled(64, 8);
+    int last = 0;
+    for (int x = 0; x < 64; x++) {
+	int r = (s->readPixel(x, 3) >> 16) & 0xff;
+	ASSERT_GE(r, last) << x;
+	ASSERT_LE(r, 240) << x;
+	last = r;
+    }
+    ASSERT_EQ(0, (s->readPixel(0, 0) >> 16) & 0xff);
+    ASSERT_EQ(240, (s->readPixel(63, 0) >> 16) & 0xff);
+    delete s;
+}
+
+TEST(Canvas, scale_by_factor_averages_blocks)
+{
+    const int factor = 3;
+    Canvas c(W*factor, H*factor);
+    fillPattern(c);
+    Canvas* s = c.scale(factor);
+    ASSERT_EQ(W, s->width());
+    ASSERT_EQ(H, s->height());
+    for (int y = 0; y < H; y++) {
+	for (int x = 0; x < W; x++) {
+	    int r = 0, g = 0, b = 0;
+	    for (int yy = 0; yy < factor; yy++) {
+		for (int xx = 0; xx < factor; xx++) {
+		    int p = c.readPixel(x*factor+xx, y*factor+yy);
+		    r += (p >> 16) & 0xff;
+		    g += (p >> 8) & 0xff;
+		    b += p & 0xff;
+		}
+	    }
+	    int n = factor*factor;
+	    ASSERT_EQ(s->makeColour(r/n, g/n, b/n), s->readPixel(x, y))
+		<< x << "," << y;
+	}
+    }
+    delete s;
+}
+
+TEST(Canvas, drawLine_joins_its_ends)
+{
+    Canvas c(W, H);
+    int colour = c.makeColour(0xffffff);
+    c.drawLine(1, 2, W-2, H-3, colour);
+    c.drawLine(W-2, 1, W-5, H-1, colour);
+    ASSERT_EQ(colour, c.readPixel(1, 2));
+    ASSERT_EQ(colour, c.readPixel(W-2, H-3));
+    ASSERT_EQ(colour, c.readPixel(W-2, 1));
+    ASSERT_EQ(colour, c.readPixel(W-5, H-1));
+    // one pixel per column along the shallow line, short of the other
+    for (int x = 1; x < W-6; x++) {
+	int n = 0;
+	for (int y = 0; y < H; y++) {
+	    if (c.readPixel(x, y) == colour) {
+		n++;
+	    }
+	}
+	ASSERT_EQ(1, n) << x;
+    }
+}
+
+TEST(Canvas, writePNG_reads_back)
+{
+    Canvas c(W, H);
+    fillPattern(c);
+    const char* file = "/tmp/CanvasTest.png";
+    ASSERT_EQ(1, c.writePNG(file));
+
+    SDL_Surface* png = IMG_Load(file);
+    ASSERT_TRUE(png != NULL) << SDL_GetError();
+    ASSERT_EQ(W, png->w);
+    ASSERT_EQ(H, png->h);
+    for (int y = 0; y < H; y++) {
+	for (int x = 0; x < W; x++) {
+	    Uint8 r, g, b;
+	    Uint8* p = (Uint8*)png->pixels + y*png->pitch + x*png->format->BytesPerPixel;
+	    Uint32 v = 0;
+	    memcpy(&v, p, png->format->BytesPerPixel);
+	    SDL_GetRGB(v, png->format, &r, &g, &b);
+	    ASSERT_EQ(c.readPixel(x, y) & 0xffffff, (r << 16) | (g << 8) | b)
+		<< x << "," << y;
+	}
+    }
+    SDL_FreeSurface(png);
+    unlink(file);
+}
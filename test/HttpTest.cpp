@@ -0,0 +1,400 @@
+#include "Http.h"
+#include <gtest/gtest.h>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
+
+
+/// Stand-in for the planet server: answers a single POST on loopback
+class LoopbackServer
+{
+public:
+    LoopbackServer( bool reply ) : m_reply(reply), m_port(0)
+    {
+	m_listen = socket( AF_INET, SOCK_STREAM, 0 );
+	sockaddr_in addr;
+	memset( &addr, 0, sizeof(addr) );
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+	addr.sin_port = 0;
+	bind( m_listen, (sockaddr*)&addr, sizeof(addr) );
+	listen( m_listen, 1 );
+	socklen_t len = sizeof(addr);
+	getsockname( m_listen, (sockaddr*)&addr, &len );
+	m_port = ntohs( addr.sin_port );
+	m_thread = SDL_CreateThread( serveThread, "LoopbackServer", this );
+    }
+    ~LoopbackServer()
+    {
+	join();
+	close( m_listen );
+    }
+
+    void join()
+    {
+	if ( m_thread ) {
+	    SDL_WaitThread( m_thread, NULL );
+	    m_thread = NULL;
+	}
+    }
+
+    std::string uri( const char* path )
+    {
+	char buf[64];
+	sprintf( buf, "http://127.0.0.1:%d%s", m_port, path );
+	return buf;
+    }
+
+    /// request as received, valid after join()
+    std::string m_request;
+
+private:
+    static int serveThread( void* self )
+    {
+	((LoopbackServer*)self)->serve();
+	return 0;
+    }
+
+    void serve()
+    {
+	int s = accept( m_listen, NULL, NULL );
+	char buf[4096];
+	int n, body = -1;
+	size_t length = 0;
+	while ( (n = recv( s, buf, sizeof(buf), 0 )) > 0 ) {
+	    m_request.append( buf, n );
+	    if ( body < 0 && m_request.find( "\r\n\r\n" ) != std::string::npos ) {
+		body = m_request.find( "\r\n\r\n" ) + 4;
+		size_t cl = m_request.find( "Content-Length: " );
+		if ( cl != std::string::npos ) {
+		    length = atoi( m_request.c_str() + cl + 16 );
+		}
+	    }
+	    if ( m_reply && body >= 0 && m_request.size() >= body + length ) {
+		const char* response =
+		    "HTTP/1.1 200 OK\r\n"
+		    "Content-Length: 2\r\n"
+		    "NP-Upload-Id: 42\r\n"
+		    "\r\n"
+		    "OK";
+		send( s, response, strlen(response), 0 );
+		break;
+	    }
+	}
+	// without a reply we hang on until the client gives up
+	close( s );
+    }
+
+    bool        m_reply;
+    int         m_listen;
+    int         m_port;
+    SDL_Thread *m_thread;
+};
+
+
+/// Serves GETs on loopback, several per connection
+class KeepAliveServer
+{
+public:
+    /// @param perConnection answers before hanging up, 0 for no limit
+    KeepAliveServer( int perConnection=0 )
+	: m_connections(0), m_perConnection(perConnection)
+    {
+	m_listen = socket( AF_INET, SOCK_STREAM, 0 );
+	sockaddr_in addr;
+	memset( &addr, 0, sizeof(addr) );
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+	bind( m_listen, (sockaddr*)&addr, sizeof(addr) );
+	listen( m_listen, 4 );
+	socklen_t len = sizeof(addr);
+	getsockname( m_listen, (sockaddr*)&addr, &len );
+	m_port = ntohs( addr.sin_port );
+	m_thread = SDL_CreateThread( serveThread, "KeepAliveServer", this );
+    }
+    ~KeepAliveServer()
+    {
+	// wakes the accept()
+	shutdown( m_listen, SHUT_RDWR );
+	SDL_WaitThread( m_thread, NULL );
+	close( m_listen );
+    }
+
+    std::string root()
+    {
+	char buf[64];
+	sprintf( buf, "http://127.0.0.1:%d", m_port );
+	return buf;
+    }
+
+    int m_connections;
+
+private:
+    static int serveThread( void* self )
+    {
+	((KeepAliveServer*)self)->serve();
+	return 0;
+    }
+
+    static std::string respond( const std::string& path, bool last )
+    {
+	std::string body;
+	const char* status = "200 OK";
+	if ( path == "/packs/test.txt" ) {
+	    body = "L1.nph\r\nL2.nph\n../evil.nph\nL3.nph\n";
+	} else if ( path.find( "missing" ) != std::string::npos ) {
+	    status = "404 Not Found";
+	} else {
+	    body = "level " + path;
+	}
+	char head[256];
+	sprintf( head, "HTTP/1.1 %s\r\nContent-Length: %d\r\n%s\r\n",
+		 status, (int)body.length(), last ? "Connection: close\r\n" : "" );
+	return head + body;
+    }
+
+    void serve()
+    {
+	int s;
+	while ( (s = accept( m_listen, NULL, NULL )) >= 0 ) {
+	    m_connections++;
+	    std::string in;
+	    char buf[4096];
+	    int answered = 0, n;
+	    bool last = false;
+	    while ( !last && (n = recv( s, buf, sizeof(buf), 0 )) > 0 ) {
+		in.append( buf, n );
+		size_t end;
+		while ( !last && (end = in.find( "\r\n\r\n" )) != std::string::npos ) {
+		    std::string path = in.substr( 4, in.find( ' ', 4 ) - 4 );
+		    in.erase( 0, end + 4 );
+		    answered++;
+		    last = m_perConnection && answered == m_perConnection;
+		    std::string out = respond( path, last );
+		    send( s, out.data(), out.length(), 0 );
+		}
+	    }
+	    // lingering close like a real server, so unread pipelined
+	    // requests don't reset the connection under our last answer
+	    shutdown( s, SHUT_WR );
+	    while ( recv( s, buf, sizeof(buf), 0 ) > 0 ) {}
+	    close( s );
+	}
+    }
+
+    int         m_listen;
+    int         m_port;
+    int         m_perConnection;
+    SDL_Thread *m_thread;
+};
+
+
+static std::string readFile( const std::string& file )
+{
+    std::string s;
+    FILE* f = fopen( file.c_str(), "rb" );
+    if ( f ) {
+	char buf[256];
+	int n;
+	while ( (n = fread( buf, 1, sizeof(buf), f )) > 0 ) {
+	    s.append( buf, n );
+	}
+	fclose( f );
+    }
+    return s;
+}
+
+
+static int g_progressCalls;
+static int g_lastSent;
+
+static bool countProgress( void*, int sent, int total )
+{
+    g_progressCalls++;
+    g_lastSent = sent;
+    return true;
+}
+
+static bool abandon( void*, int sent, int total )
+{
+    return sent < total;
+}
+
+static std::string writeLevel( int lines=1000 )
+{
+    std::string file = "HttpTest.nph";
+    FILE* f = fopen( file.c_str(), "wt" );
+    for ( int i=0; i<lines; i++ ) {
+	fprintf( f, "S4,0,1,0:%d,%d,%d,%d\n", i, i+1, i+2, i+3 );
+    }
+    fclose( f );
+    return file;
+}
+
+
+TEST(Http, post_reports_progress)
+{
+    std::string file = writeLevel();
+    LoopbackServer server( true );
+    Http h;
+    g_progressCalls = 0;
+    g_lastSent = 0;
+    ASSERT_TRUE(h.post( server.uri("/upload").c_str(), "data", file.c_str(),
+			"type=1", countProgress, NULL ));
+    ASSERT_EQ("42", h.getHeader("NP-Upload-Id"));
+    ASSERT_GT(g_progressCalls, 1);
+    server.join();
+
+    // body went out in full, after the headers
+    const std::string& req = server.m_request;
+    ASSERT_EQ(0u, req.find("POST /upload HTTP/1.1"));
+    size_t body = req.find("\r\n\r\n") + 4;
+    ASSERT_EQ(0, req.compare(body, 12, "type=1&data="));
+    ASSERT_EQ(g_lastSent, (int)(req.size() - body));
+    unlink( file.c_str() );
+}
+
+TEST(Http, post_large_level)
+{
+    // well past the old 64K encoding buffer once percent encoded
+    std::string file = writeLevel( 20000 );
+    LoopbackServer server( true );
+    Http h;
+    ASSERT_TRUE(h.post( server.uri("/upload").c_str(), "data", file.c_str(),
+			"type=1" ));
+    server.join();
+    ASSERT_GT(server.m_request.size(), 3*64*1024u);
+    unlink( file.c_str() );
+}
+
+TEST(Http, post_multipart)
+{
+    std::string file = writeLevel( 20000 );
+    LoopbackServer server( true );
+    Http h;
+    h.encoding( Http::MULTIPART );
+    ASSERT_TRUE(h.post( server.uri("/upload").c_str(), "data", file.c_str(),
+			"type=1" ));
+    server.join();
+
+    const std::string& req = server.m_request;
+    ASSERT_NE(std::string::npos, req.find("Content-type: multipart/form-data; boundary="));
+    ASSERT_NE(std::string::npos, req.find("name=\"type\"\r\n\r\n1\r\n"));
+    ASSERT_NE(std::string::npos, req.find("name=\"data\"; filename=\"HttpTest.nph\""));
+    // raw bytes, no percent encoding
+    ASSERT_NE(std::string::npos, req.find("S4,0,1,0:19999,20000,20001,20002\n"));
+    ASSERT_LT(req.size(), 2*20000*32u);
+    unlink( file.c_str() );
+}
+
+TEST(Http, post_cancel)
+{
+    std::string file = writeLevel();
+    LoopbackServer server( false );
+    Http h;
+    ASSERT_FALSE(h.post( server.uri("/upload").c_str(), "data", file.c_str(),
+			 "type=1", abandon, NULL ));
+    ASSERT_EQ("cancelled", h.errorMessage());
+    unlink( file.c_str() );
+}
+
+TEST(Http, upload)
+{
+    std::string file = writeLevel();
+    LoopbackServer server( true );
+    HttpUpload upload( server.uri("/upload"), "data", file, "type=1" );
+    upload.start();
+    ASSERT_TRUE(upload.ok());
+    ASSERT_EQ("42", upload.http().getHeader("NP-Upload-Id"));
+    unlink( file.c_str() );
+}
+
+TEST(Http, upload_cancel)
+{
+    std::string file = writeLevel();
+    LoopbackServer server( false );
+    HttpUpload upload( server.uri("/upload"), "data", file, "type=1" );
+    upload.start();
+    SDL_Delay( 50 );
+    upload.cancel();
+    // the server never answers so only cancelling gets us past this
+    ASSERT_FALSE(upload.ok());
+    unlink( file.c_str() );
+}
+
+TEST(HttpClient, pipelined_gets_share_a_connection)
+{
+    KeepAliveServer server;
+    HttpClient client( server.root() );
+    char path[32], file[32];
+    for ( int i=0; i<20; i++ ) {
+	sprintf( path, "/L%d.nph", i );
+	sprintf( file, "HttpTest%d.nph", i );
+	client.get( path, file );
+    }
+    ASSERT_EQ(20, client.fetch());
+    ASSERT_EQ(1, client.connections());
+    for ( int i=0; i<20; i++ ) {
+	sprintf( path, "level /L%d.nph", i );
+	sprintf( file, "HttpTest%d.nph", i );
+	ASSERT_EQ(path, readFile( file ));
+	unlink( file );
+    }
+}
+
+TEST(HttpClient, reconnects_when_server_closes)
+{
+    KeepAliveServer server( 3 );
+    HttpClient client( server.root() );
+    char file[32];
+    for ( int i=0; i<10; i++ ) {
+	sprintf( file, "HttpTest%d.nph", i );
+	client.get( "/level.nph", file );
+    }
+    ASSERT_EQ(10, client.fetch());
+    // any pipelined beyond the third on a connection have to be resent
+    ASSERT_GE(client.connections(), 4);
+    for ( int i=0; i<10; i++ ) {
+	sprintf( file, "HttpTest%d.nph", i );
+	ASSERT_EQ("level /level.nph", readFile( file ));
+	unlink( file );
+    }
+}
+
+TEST(HttpClient, sync_pack)
+{
+    // L1 is already here and ../evil is refused
+    KeepAliveServer server;
+    mkdir( "HttpTestPack", 0755 );
+    FILE* f = fopen( "HttpTestPack/L1.nph", "wt" );
+    fputs( "mine", f );
+    fclose( f );
+
+    HttpClient client( server.root() );
+    ASSERT_EQ(2, client.syncPack( "test", "HttpTestPack" ));
+    ASSERT_EQ(1, client.connections());
+    ASSERT_EQ("mine", readFile( "HttpTestPack/L1.nph" ));
+    ASSERT_EQ("level /packs/test/L2.nph", readFile( "HttpTestPack/L2.nph" ));
+    ASSERT_EQ("level /packs/test/L3.nph", readFile( "HttpTestPack/L3.nph" ));
+    ASSERT_EQ("", readFile( "HttpTestPack/test.txt" ));
+    unlink( "HttpTestPack/L1.nph" );
+    unlink( "HttpTestPack/L2.nph" );
+    unlink( "HttpTestPack/L3.nph" );
+    rmdir( "HttpTestPack" );
+}
+
+TEST(HttpClient, missing_file)
+{
+    KeepAliveServer server;
+    HttpClient client( server.root() );
+    client.get( "/missing.nph", "HttpTestMissing.nph" );
+    client.get( "/L1.nph", "HttpTest1.nph" );
+    ASSERT_EQ(1, client.fetch());
+    ASSERT_EQ("", readFile( "HttpTestMissing.nph" ));
+    unlink( "HttpTest1.nph" );
+}
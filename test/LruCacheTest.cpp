@@ -0,0 +1,66 @@
+#include "LruCache.h"
+#include <gtest/gtest.h>
+
+
+/// counts live instances so tests can see what the cache deleted
+struct Counted
+{
+    Counted( int v ) : value(v) { live++; }
+    ~Counted() { live--; }
+    int value;
+    static int live;
+};
+int Counted::live = 0;
+
+
+TEST(LruCache, evicts_least_recently_used)
+{
+    {
+	LruCache<int,Counted> cache( 30 );
+	cache.insert( 1, new Counted(1), 10 );
+	cache.insert( 2, new Counted(2), 10 );
+	cache.insert( 3, new Counted(3), 10 );
+	ASSERT_EQ(30, cache.bytes());
+	ASSERT_EQ(1, cache.find(1)->value);  // 2 is now the oldest
+	cache.insert( 4, new Counted(4), 10 );
+	ASSERT_EQ(3, cache.size());
+	ASSERT_TRUE(cache.find(2) == NULL);
+	ASSERT_TRUE(cache.contains(1));
+	ASSERT_TRUE(cache.contains(3));
+	ASSERT_TRUE(cache.contains(4));
+	ASSERT_EQ(3, Counted::live);
+	ASSERT_EQ(1, cache.hits());
+	ASSERT_EQ(1, cache.misses());
+    }
+    ASSERT_EQ(0, Counted::live);
+}
+
+TEST(LruCache, keeps_oversized_newest_entry)
+{
+    LruCache<int,Counted> cache( 10 );
+    cache.insert( 1, new Counted(1), 5 );
+    cache.insert( 2, new Counted(2), 50 );
+    ASSERT_EQ(1, cache.size());
+    ASSERT_EQ(2, cache.find(2)->value);
+    cache.maxBytes( 0 );
+    ASSERT_EQ(0, cache.size());
+    ASSERT_EQ(0, cache.bytes());
+    ASSERT_EQ(0, Counted::live);
+}
+
+TEST(LruCache, erase_range)
+{
+    LruCache<int,Counted> cache( 1000 );
+    for ( int i=0; i<10; i++ ) {
+	cache.insert( i, new Counted(i), 1 );
+    }
+    cache.erase( 3, 6 );
+    ASSERT_EQ(6, cache.size());
+    ASSERT_EQ(6, cache.bytes());
+    ASSERT_TRUE(cache.contains(2));
+    ASSERT_FALSE(cache.contains(3));
+    ASSERT_FALSE(cache.contains(6));
+    ASSERT_TRUE(cache.contains(7));
+    cache.clear();
+    ASSERT_EQ(0, Counted::live);
+}
@@ -1,6 +1,9 @@
 #include "Scene.h"
+#include "Config.h"
+#include <cstring>
 #include <gtest/gtest.h>
 #include <ostream>
+#include <vector>
 
 
 TEST(Scene, constructor_trivial)
@@ -8,3 +11,101 @@ TEST(Scene, constructor_trivial)
     Scene s;
 }
 
+
+static const char* DYNAMIC_ONLY = "S3:100,100 200,150 260,120\n";
+static const char* WITH_GROUND =
+    "S3:100,100 200,150 260,120\n"
+    "Sf2:10,400 300,380 700,400\n";
+
+static void drawScene(Scene& scene, Canvas& canvas)
+{
+    scene.draw(canvas, Rect(0, 0, canvas.width()-1, canvas.height()-1));
+}
+
+static bool samePixels(const Canvas& a, const Canvas& b)
+{
+    for (int y = 0; y < a.height(); y++) {
+	for (int x = 0; x < a.width(); x++) {
+	    if (a.readPixel(x, y) != b.readPixel(x, y)) {
+		return false;
+	    }
+	}
+    }
+    return true;
+}
+
+TEST(Scene, static_layer_follows_edits)
+{
+    Scene withGround;
+    withGround.load((unsigned char*)WITH_GROUND, strlen(WITH_GROUND));
+    Canvas expectGround(SCREEN_WIDTH, SCREEN_HEIGHT);
+    drawScene(withGround, expectGround);
+
+    Scene dynamicOnly;
+    dynamicOnly.load((unsigned char*)DYNAMIC_ONLY, strlen(DYNAMIC_ONLY));
+    Canvas expectNone(SCREEN_WIDTH, SCREEN_HEIGHT);
+    drawScene(dynamicOnly, expectNone);
+    ASSERT_FALSE(samePixels(expectGround, expectNone));
+
+    // the same scene edited, redrawn into one canvas each time
+    Scene scene;
+    scene.load((unsigned char*)DYNAMIC_ONLY, strlen(DYNAMIC_ONLY));
+    Canvas canvas(SCREEN_WIDTH, SCREEN_HEIGHT);
+    drawScene(scene, canvas);
+    ASSERT_TRUE(samePixels(expectNone, canvas));
+
+    Stroke* ground = scene.newStroke(Path("10,400 300,380 700,400"), 2,
+				     ATTRIB_GROUND);
+    drawScene(scene, canvas);
+    ASSERT_TRUE(samePixels(expectGround, canvas));
+
+    scene.deleteStroke(ground);
+    drawScene(scene, canvas);
+    ASSERT_TRUE(samePixels(expectNone, canvas));
+}
+
+// a stroke drawn and let go part way through the replay
+static const char* REPLAYED =
+    "S3:100,100 200,150 260,120\n"
+    "Sf2:10,400 300,380 700,400\n"
+    "E: 30,n,-1,3,0,400,100\n"
+    "E: 31,e,2,0,0,450,110\n"
+    "E: 32,e,2,0,0,500,100\n"
+    "E: 33,a,2,-1,-1,-1,-1\n";
+
+TEST(Scene, seek_matches_uninterrupted_replay)
+{
+    const int END = REPLAY_KEYFRAME_TICKS + 30;
+    std::vector<unsigned> hashes(END + 1);
+    Scene straight;
+    straight.load((unsigned char*)REPLAYED, strlen(REPLAYED));
+    straight.start(true);
+    for (int t = 1; t <= END; t++) {
+	straight.step();
+	ASSERT_EQ(t, straight.replay()->ticks());
+	hashes[t] = straight.stateHash();
+    }
+
+    Scene scene;
+    scene.load((unsigned char*)REPLAYED, strlen(REPLAYED));
+    scene.start(true);
+    // forward past the first keyframe, simulating all the way
+    ASSERT_TRUE(scene.seek(END));
+    ASSERT_EQ(hashes[END], scene.stateHash());
+
+    // back before any keyframe, which reloads the level
+    ASSERT_TRUE(scene.seek(10));
+    ASSERT_EQ(10, scene.replay()->ticks());
+    ASSERT_EQ(hashes[10], scene.stateHash());
+    ASSERT_EQ(-1, scene.divergedAt());
+
+    // forward in small steps to just before the stroke is let go
+    while (!scene.seek(32, 5)) {
+    }
+    ASSERT_EQ(hashes[32], scene.stateHash());
+    ASSERT_EQ(3u, scene.strokes().size());
+
+    // forward onto the keyframe, which restores it without simulating
+    ASSERT_TRUE(scene.seek(REPLAY_KEYFRAME_TICKS));
+    ASSERT_EQ(hashes[REPLAY_KEYFRAME_TICKS], scene.stateHash());
+}
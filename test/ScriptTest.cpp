@@ -0,0 +1,104 @@
+#include "Script.h"
+#include <gtest/gtest.h>
+#include <stdexcept>
+
+
+static ScriptKeyframe keyframe( int t )
+{
+    ScriptKeyframe k;
+    k.t = t;
+    k.isPaused = false;
+    return k;
+}
+
+
+TEST(ScriptLog, indexAfter)
+{
+    ScriptLog log;
+    log.append( 1, ScriptEntry::OP_NEW );
+    log.append( 5, ScriptEntry::OP_EXTEND );
+    log.append( 5, ScriptEntry::OP_ACTIVATE );
+    log.append( 9, ScriptEntry::OP_PAUSE );
+
+    ASSERT_EQ(0, log.indexAfter(0));
+    ASSERT_EQ(1, log.indexAfter(1));
+    ASSERT_EQ(1, log.indexAfter(4));
+    ASSERT_EQ(3, log.indexAfter(5));
+    ASSERT_EQ(4, log.indexAfter(9));
+    ASSERT_EQ(4, log.indexAfter(100));
+}
+
+TEST(ScriptLog, findKeyframe)
+{
+    ScriptLog log;
+    ASSERT_TRUE(log.findKeyframe(10) == NULL);
+
+    log.addKeyframe( keyframe(20) );
+    log.addKeyframe( keyframe(10) );
+    log.addKeyframe( keyframe(30) );
+    log.addKeyframe( keyframe(20) );
+    ASSERT_EQ(3, log.numKeyframes());
+
+    ASSERT_TRUE(log.findKeyframe(9) == NULL);
+    ASSERT_EQ(10, log.findKeyframe(10)->t);
+    ASSERT_EQ(10, log.findKeyframe(19)->t);
+    ASSERT_EQ(20, log.findKeyframe(29)->t);
+    ASSERT_EQ(30, log.findKeyframe(1000)->t);
+
+    ASSERT_TRUE(log.hasKeyframe(20));
+    ASSERT_FALSE(log.hasKeyframe(25));
+}
+
+TEST(ScriptLog, clear_drops_keyframes)
+{
+    ScriptLog log;
+    log.append( 1, ScriptEntry::OP_NEW );
+    log.addKeyframe( keyframe(10) );
+    log.clear();
+    ASSERT_EQ(0, log.size());
+    ASSERT_EQ(0, log.numKeyframes());
+}
+
+TEST(ScriptPlayer, seek)
+{
+    ScriptLog log;
+    ScriptPlayer player;
+    log.append( 1, ScriptEntry::OP_NEW );
+    player.start( &log, NULL );
+    player.seek( 40, true );
+    ASSERT_EQ(40, player.ticks());
+    ASSERT_TRUE(player.isPaused());
+}
+
+TEST(ScriptLog, hash_round_trip)
+{
+    ScriptLog log;
+    log.addHash( 60, 0xdeadbeef );
+    log.appendHash( "120,0000002a" );
+    ASSERT_EQ(2, log.numHashes());
+    ASSERT_EQ(120, log.lastHashTick());
+    ASSERT_EQ("60,deadbeef", log.hashString(0));
+
+    unsigned h = 0;
+    ASSERT_TRUE(log.findHash(120, h));
+    ASSERT_EQ(42u, h);
+    ASSERT_FALSE(log.findHash(90, h));
+}
+
+TEST(ScriptLog, hash_malformed)
+{
+    ScriptLog log;
+    ASSERT_THROW(log.appendHash("garbage"), std::invalid_argument);
+}
+
+TEST(ScriptRecorder, user_ops_apply_next_tick)
+{
+    ScriptLog log;
+    ScriptRecorder rec;
+    rec.start( &log );
+    rec.tick( false );
+    rec.tick( false );
+    rec.activateStroke( 3 );
+    ASSERT_EQ(1, log.size());
+    ASSERT_EQ(3, log[0].t);
+}
@@ -0,0 +1,146 @@
+#include "Worker.h"
+#include <gtest/gtest.h>
+#include <vector>
+
+
+class Square : public Future<int>
+{
+public:
+    Square( int v, int priority=NORMAL ) : Future<int>(priority), m_v(v) {}
+protected:
+    int compute() { return m_v * m_v; }
+private:
+    int m_v;
+};
+
+/// blocks its worker until released
+class Gate : public Task
+{
+public:
+    Gate() { SDL_AtomicSet( &m_open, 0 ); SDL_AtomicSet( &m_started, 0 ); }
+    void open() { SDL_AtomicSet( &m_open, 1 ); }
+    void waitStarted() { while ( !SDL_AtomicGet( &m_started ) ) SDL_Delay( 1 ); }
+    void run() {
+	SDL_AtomicSet( &m_started, 1 );
+	while ( !SDL_AtomicGet( &m_open ) ) SDL_Delay( 1 );
+    }
+private:
+    SDL_atomic_t m_open;
+    SDL_atomic_t m_started;
+};
+
+/// records the order tasks ran in
+class Recorder : public Task
+{
+public:
+    Recorder( int id, int priority, std::vector<int>& log, SDL_mutex* m )
+	: Task(priority), m_id(id), m_log(log), m_mutex(m) {}
+    void run() {
+	SDL_LockMutex( m_mutex );
+	m_log.push_back( m_id );
+	SDL_UnlockMutex( m_mutex );
+    }
+private:
+    int m_id;
+    std::vector<int>& m_log;
+    SDL_mutex* m_mutex;
+};
+
+
+TEST(ThreadPool, futures)
+{
+    ThreadPool pool( 4 );
+    std::vector<Square*> tasks;
+    for ( int i=0; i<100; i++ ) {
+	tasks.push_back( new Square(i) );
+	pool.submit( tasks.back() );
+    }
+    for ( int i=0; i<100; i++ ) {
+	ASSERT_EQ(i*i, tasks[i]->result());
+	ASSERT_TRUE(tasks[i]->done());
+	delete tasks[i];
+    }
+}
+
+TEST(ThreadPool, priority_order)
+{
+    ThreadPool pool( 1 );
+    SDL_mutex* m = SDL_CreateMutex();
+    std::vector<int> log;
+    Gate gate;
+    pool.submit( &gate );
+    Recorder low( 1, Task::LOW, log, m );
+    Recorder normal( 2, Task::NORMAL, log, m );
+    Recorder high( 3, Task::HIGH, log, m );
+    pool.submit( &low );
+    pool.submit( &normal );
+    pool.submit( &high );
+    gate.open();
+    low.wait();
+    normal.wait();
+    high.wait();
+    ASSERT_EQ(3u, log.size());
+    ASSERT_EQ(3, log[0]);
+    ASSERT_EQ(2, log[1]);
+    ASSERT_EQ(1, log[2]);
+    SDL_DestroyMutex( m );
+}
+
+TEST(ThreadPool, cancel_queued)
+{
+    ThreadPool pool( 1 );
+    Gate gate;
+    Square sq( 7 );
+    pool.submit( &gate );
+    pool.submit( &sq );
+    ASSERT_TRUE(sq.cancel());
+    ASSERT_TRUE(sq.cancelled());
+    ASSERT_EQ(0, sq.result());
+    gate.open();
+    gate.wait();
+    ASSERT_FALSE(gate.cancelled());
+}
+
+TEST(ThreadPool, idle_worker_steals)
+{
+    ThreadPool pool( 2 );
+    Gate gate;
+    pool.submit( &gate );
+    gate.waitStarted();
+    // submissions alternate between the deques, so half of these queue
+    // behind the gate and only finish if the free worker steals them
+    std::vector<Square*> tasks;
+    for ( int i=0; i<10; i++ ) {
+	tasks.push_back( new Square(i) );
+	pool.submit( tasks.back() );
+    }
+    for ( int i=0; i<10; i++ ) {
+	ASSERT_EQ(i*i, tasks[i]->result());
+	delete tasks[i];
+    }
+    ASSERT_FALSE(gate.done());
+    gate.open();
+    gate.wait();
+}
+
+static void addInto( int a, int b, int* sum )
+{
+    *sum = a + b;
+}
+
+TEST(WorkerF, runs_function_on_pool)
+{
+    std::vector<int> sums( 20, -1 );
+    std::vector<WorkerF<int,int,int*>*> workers;
+    for ( int i=0; i<20; i++ ) {
+	workers.push_back( new WorkerF<int,int,int*>( addInto, i, 100, &sums[i] ) );
+	workers.back()->notify( false );
+	workers.back()->start( "add" );
+    }
+    for ( int i=0; i<20; i++ ) {
+	workers[i]->wait();
+	ASSERT_FALSE(workers[i]->cancelled());
+	ASSERT_EQ(i+100, sums[i]);
+	delete workers[i];
+    }
+}